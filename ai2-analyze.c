@@ -0,0 +1,697 @@
+// SPDX-License-Identifier: MIT
+/*
+ * ai2-analyze - statistics per byte offset of AI2 reports, to find out
+ * what the unknown fields are.
+ *
+ * Reads the "class, type, hexdata" lines of read-gps noprocess dumps.
+ * For every report type and offset, taken as u8, s16 and s32, it
+ * computes entropy, change rate between consecutive reports, value
+ * range, monotonicity and the correlation with the fields we know.
+ * The satellite records of measurement, position and position_ext
+ * reports are analyzed as types of their own ("sv"), consecutive
+ * there means of the same satellite.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "ai2.h"
+
+enum {
+	FIELD_FCOUNT,
+	FIELD_LAT,
+	FIELD_LON,
+	FIELD_ALT,
+	FIELD_SNR,
+	FIELDS,
+};
+
+static const char *field_names[FIELDS] = {
+	"fcount", "lat", "lon", "alt", "snr",
+};
+
+static const int widths[] = { 1, 2, 4 };
+#define WIDTHS 3
+
+/*
+ * Offsets past this are not analyzed, every offset costs a few KB
+ * per thread and NMEA or debug reports may be long.
+ */
+#define MAX_OFFSETS 256
+
+/* a report or a satellite record of one */
+struct sample {
+	unsigned int group;
+	/* SV number of satellite records, 0 otherwise */
+	unsigned int key;
+	unsigned int len;
+	size_t data;
+	double field[FIELDS];
+};
+
+/* what one input file turned into */
+struct input {
+	const char *path;
+	struct sample *samples;
+	size_t count;
+	size_t size;
+	uint8_t *data;
+	size_t datalen;
+	size_t datasize;
+};
+
+/* class, type and whether it is the satellite records */
+#define GROUP(class, type, sv) (((class) << 9) | ((type) << 1) | (sv))
+#define GROUPS (1 << 11)
+
+/* co-moments, mergeable (Chan et al.) */
+struct corr {
+	double n, mx, my, m2x, m2y, cxy;
+};
+
+struct offset_stats {
+	unsigned long n;
+	double min, max;
+	/* of consecutive values with the same key */
+	unsigned long pairs;
+	unsigned long changes;
+	unsigned long up, down;
+	bool have;
+	double first, last;
+	unsigned int first_key, last_key;
+	struct corr corr[FIELDS];
+	/* bytes only */
+	unsigned long *hist;
+};
+
+struct group_stats {
+	unsigned int maxlen;
+	struct offset_stats *off[WIDTHS];
+};
+
+static int nthreads;
+static struct input *inputs;
+static int ninputs;
+static int next_input;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* per group the samples of all inputs in order */
+static struct {
+	const struct sample **samples;
+	const uint8_t **data;
+	size_t count;
+	unsigned int maxlen;
+} groups[GROUPS];
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+static struct sample *add_sample(struct input *in, unsigned int group,
+				 const uint8_t *data, unsigned int len,
+				 const double *field)
+{
+	struct sample *s;
+
+	if (in->count == in->size) {
+		in->size = in->size ? 2 * in->size : 4096;
+		in->samples = xrealloc(in->samples, in->size * sizeof(*s));
+	}
+	if (in->datalen + len > in->datasize) {
+		while (in->datalen + len > in->datasize)
+			in->datasize = in->datasize ? 2 * in->datasize : 65536;
+		in->data = xrealloc(in->data, in->datasize);
+	}
+
+	s = &in->samples[in->count++];
+	s->group = group;
+	s->key = 0;
+	s->len = len;
+	s->data = in->datalen;
+	memcpy(s->field, field, sizeof(s->field));
+	memcpy(in->data + in->datalen, data, len);
+	in->datalen += len;
+	return s;
+}
+
+static void add_records(struct input *in, uint8_t class, uint8_t type,
+			const uint8_t *data, unsigned int len, size_t head,
+			size_t reclen, double *field)
+{
+	unsigned int group = GROUP(class, type, 1);
+	size_t pos;
+
+	for (pos = head; pos + reclen <= len; pos += reclen) {
+		if (type == AI2_MEASUREMENT) {
+			uint16_t snr;
+
+			memcpy(&snr, data + pos + offsetof(struct measurement_sv, svdata[0].snr) -
+			       offsetof(struct measurement_sv, svdata[0]), sizeof(snr));
+			field[FIELD_SNR] = snr / 10.0;
+		}
+		add_sample(in, group, data + pos, reclen, field)->key = data[pos];
+	}
+	field[FIELD_SNR] = NAN;
+}
+
+static int hexval(int c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Known fields come from the report itself or the latest one
+ * carrying them, so other reports of the same epoch get them too.
+ */
+static void parse_input(struct input *in)
+{
+	double field[FIELDS] = { NAN, NAN, NAN, NAN, NAN };
+	uint8_t *data = malloc(65536);
+	char *line = NULL;
+	size_t size = 0;
+	FILE *f;
+
+	f = strcmp(in->path, "-") ? fopen(in->path, "r") : stdin;
+	if (!f || !data) {
+		perror(in->path);
+		exit(1);
+	}
+
+	while (getline(&line, &size, f) > 0) {
+		unsigned int class, type, len = 0;
+		const char *p;
+		int pos;
+		int hi, lo;
+
+		/* the C array variant of the same packet */
+		if (!strncmp(line, "0x", 2))
+			continue;
+
+		if ((sscanf(line, "%2x, %2x, %n", &class, &type, &pos) != 2) || (class > 3))
+			continue;
+
+		for (p = line + pos; (len < 65536) && ((hi = hexval(p[0])) >= 0) &&
+		     ((lo = hexval(p[1])) >= 0); p += 2)
+			data[len++] = (hi << 4) | lo;
+
+		if ((len >= 4) && ((type == AI2_MEASUREMENT) || (type == AI2_POSITION) ||
+				   (type == AI2_POSITION_EXT) || (type == AI2_NMEA))) {
+			uint32_t fcount;
+
+			memcpy(&fcount, data, sizeof(fcount));
+			field[FIELD_FCOUNT] = fcount;
+		}
+
+		if ((type == AI2_POSITION) && (len >= offsetof(struct position, svdata))) {
+			struct position pos;
+
+			memcpy(&pos, data, sizeof(pos));
+			field[FIELD_LAT] = (double)pos.lat * 90 / 2147483648.0;
+			field[FIELD_LON] = (double)pos.lon * 180 / 2147483648.0;
+			field[FIELD_ALT] = (double)pos.altitude / 2;
+		}
+
+		add_sample(in, GROUP(class, type, 0), data, len, field);
+
+		switch (type) {
+		case AI2_MEASUREMENT:
+			add_records(in, class, type, data, len,
+				    offsetof(struct measurement_sv, svdata),
+				    sizeof(((struct measurement_sv *)0)->svdata[0]), field);
+			break;
+		case AI2_POSITION:
+			add_records(in, class, type, data, len,
+				    offsetof(struct position, svdata),
+				    sizeof(((struct position *)0)->svdata[0]), field);
+			break;
+		case AI2_POSITION_EXT:
+			add_records(in, class, type, data, len,
+				    offsetof(struct position_ext, svdata),
+				    sizeof(((struct position_ext *)0)->svdata[0]), field);
+			break;
+		}
+	}
+
+	free(line);
+	free(data);
+	if (f != stdin)
+		fclose(f);
+}
+
+static void *parse_thread(void *arg)
+{
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&input_lock);
+		i = next_input++;
+		pthread_mutex_unlock(&input_lock);
+		if (i >= ninputs)
+			return NULL;
+
+		parse_input(&inputs[i]);
+	}
+}
+
+static double value_at(const uint8_t *data, unsigned int off, int width)
+{
+	uint8_t u8;
+	int16_t s16;
+	int32_t s32;
+
+	switch (width) {
+	case 1:
+		u8 = data[off];
+		return u8;
+	case 2:
+		memcpy(&s16, data + off, sizeof(s16));
+		return s16;
+	default:
+		memcpy(&s32, data + off, sizeof(s32));
+		return s32;
+	}
+}
+
+static void corr_add(struct corr *c, double x, double y)
+{
+	double dx, dy;
+
+	c->n++;
+	dx = x - c->mx;
+	c->mx += dx / c->n;
+	dy = y - c->my;
+	c->my += dy / c->n;
+	c->m2x += dx * (x - c->mx);
+	c->m2y += dy * (y - c->my);
+	c->cxy += dx * (y - c->my);
+}
+
+static void corr_merge(struct corr *a, const struct corr *b)
+{
+	double n = a->n + b->n;
+	double dx = b->mx - a->mx;
+	double dy = b->my - a->my;
+
+	if (!b->n)
+		return;
+
+	if (!a->n) {
+		*a = *b;
+		return;
+	}
+
+	a->m2x += b->m2x + dx * dx * a->n * b->n / n;
+	a->m2y += b->m2y + dy * dy * a->n * b->n / n;
+	a->cxy += b->cxy + dx * dy * a->n * b->n / n;
+	a->mx += dx * b->n / n;
+	a->my += dy * b->n / n;
+	a->n = n;
+}
+
+static double corr_r(const struct corr *c)
+{
+	if ((c->n < 2) || (c->m2x <= 0) || (c->m2y <= 0))
+		return NAN;
+
+	return c->cxy / sqrt(c->m2x * c->m2y);
+}
+
+static void pair_add(struct offset_stats *o, double prev, double v)
+{
+	o->pairs++;
+	if (v != prev)
+		o->changes++;
+	if (v > prev)
+		o->up++;
+	if (v < prev)
+		o->down++;
+}
+
+static void stats_add(struct offset_stats *o, double v, const double *field,
+		      unsigned int key)
+{
+	int k;
+
+	if (!o->n || (v < o->min))
+		o->min = v;
+	if (!o->n || (v > o->max))
+		o->max = v;
+	o->n++;
+
+	if (!o->have) {
+		o->first = v;
+		o->first_key = key;
+	} else if (o->last_key == key) {
+		pair_add(o, o->last, v);
+	}
+	o->have = true;
+	o->last = v;
+	o->last_key = key;
+
+	for (k = 0; k < FIELDS; k++)
+		if (!isnan(field[k]))
+			corr_add(&o->corr[k], v, field[k]);
+
+	if (o->hist)
+		o->hist[(uint8_t)v]++;
+}
+
+/* b follows a in the sample order */
+static void stats_merge(struct offset_stats *a, const struct offset_stats *b)
+{
+	int k;
+
+	if (!b->n)
+		return;
+
+	if (!a->n) {
+		unsigned long *hist = a->hist;
+
+		*a = *b;
+		a->hist = hist;
+		if (hist)
+			memcpy(hist, b->hist, 256 * sizeof(*hist));
+		return;
+	}
+
+	if (b->min < a->min)
+		a->min = b->min;
+	if (b->max > a->max)
+		a->max = b->max;
+	a->n += b->n;
+	a->pairs += b->pairs;
+	a->changes += b->changes;
+	a->up += b->up;
+	a->down += b->down;
+	/* the pair across the boundary */
+	if (a->last_key == b->first_key)
+		pair_add(a, a->last, b->first);
+	a->last = b->last;
+	a->last_key = b->last_key;
+
+	for (k = 0; k < FIELDS; k++)
+		corr_merge(&a->corr[k], &b->corr[k]);
+
+	if (a->hist)
+		for (k = 0; k < 256; k++)
+			a->hist[k] += b->hist[k];
+}
+
+static void group_stats_init(struct group_stats *g, unsigned int maxlen)
+{
+	unsigned int off;
+	int w;
+
+	g->maxlen = maxlen;
+	for (w = 0; w < WIDTHS; w++) {
+		g->off[w] = calloc(maxlen ? maxlen : 1, sizeof(*g->off[w]));
+		if (!g->off[w]) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+	for (off = 0; off < maxlen; off++) {
+		g->off[0][off].hist = calloc(256, sizeof(unsigned long));
+		if (!g->off[0][off].hist) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+}
+
+static void group_stats_free(struct group_stats *g)
+{
+	unsigned int off;
+	int w;
+
+	for (off = 0; off < g->maxlen; off++)
+		free(g->off[0][off].hist);
+	for (w = 0; w < WIDTHS; w++)
+		free(g->off[w]);
+}
+
+/* each thread takes its share of the samples of every group */
+struct work {
+	int index;
+	struct group_stats *stats[GROUPS];
+};
+
+static void *analyze_thread(void *arg)
+{
+	struct work *work = arg;
+	int gi;
+
+	for (gi = 0; gi < GROUPS; gi++) {
+		size_t count = groups[gi].count;
+		size_t from = count * work->index / nthreads;
+		size_t to = count * (work->index + 1) / nthreads;
+		struct group_stats *g;
+		size_t i;
+
+		if (!count)
+			continue;
+
+		g = calloc(1, sizeof(*g));
+		if (!g) {
+			perror("calloc");
+			exit(1);
+		}
+		group_stats_init(g, groups[gi].maxlen);
+		work->stats[gi] = g;
+		for (i = from; i < to; i++) {
+			const struct sample *s = groups[gi].samples[i];
+			const uint8_t *data = groups[gi].data[i];
+			unsigned int len = s->len < g->maxlen ? s->len : g->maxlen;
+			unsigned int off;
+			int w;
+
+			for (w = 0; w < WIDTHS; w++)
+				for (off = 0; off + widths[w] <= len; off++)
+					stats_add(&g->off[w][off],
+						  value_at(data, off, widths[w]), s->field, s->key);
+		}
+	}
+	return NULL;
+}
+
+/* stable, so each satellite's records stay in sample order */
+static void sort_by_key(int gi)
+{
+	size_t count = groups[gi].count;
+	const struct sample **samples = xrealloc(NULL, count * sizeof(*samples));
+	const uint8_t **data = xrealloc(NULL, count * sizeof(*data));
+	size_t start[257] = { 0 };
+	size_t i;
+	int k;
+
+	for (i = 0; i < count; i++)
+		start[groups[gi].samples[i]->key + 1]++;
+	for (k = 1; k < 257; k++)
+		start[k] += start[k - 1];
+	for (i = 0; i < count; i++) {
+		size_t n = start[groups[gi].samples[i]->key]++;
+
+		samples[n] = groups[gi].samples[i];
+		data[n] = groups[gi].data[i];
+	}
+
+	free(groups[gi].samples);
+	free(groups[gi].data);
+	groups[gi].samples = samples;
+	groups[gi].data = data;
+}
+
+static double entropy(const unsigned long *hist, unsigned long n)
+{
+	double e = 0;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		double p = (double)hist[i] / n;
+
+		if (hist[i])
+			e -= p * log2(p);
+	}
+	return e;
+}
+
+static void print_group(int gi, const struct group_stats *g)
+{
+	unsigned int off;
+	int w, k;
+
+	printf("== %02x %02x%s: %zu samples, up to %u bytes\n",
+	       gi >> 9, (gi >> 1) & 0xff, (gi & 1) ? " sv" : "",
+	       groups[gi].count, g->maxlen);
+	printf("off w      n          min          max entropy change mono");
+	for (k = 0; k < FIELDS; k++)
+		printf(" %7s", field_names[k]);
+	printf("\n");
+
+	for (off = 0; off < g->maxlen; off++) {
+		for (w = 0; w < WIDTHS; w++) {
+			const struct offset_stats *o;
+			const char *mono = "";
+			unsigned long pairs;
+
+			if (off + widths[w] > g->maxlen)
+				continue;
+
+			o = &g->off[w][off];
+			if (!o->n)
+				continue;
+
+			/* a wider view of a constant adds nothing */
+			if ((w > 0) && (o->min == o->max))
+				continue;
+
+			pairs = o->pairs;
+			if (o->min == o->max)
+				mono = "const";
+			else if (!o->down)
+				mono = "up";
+			else if (!o->up)
+				mono = "down";
+
+			printf("%3u %d %6lu %12.0f %12.0f", off, widths[w], o->n, o->min, o->max);
+			if (o->hist)
+				printf(" %7.3f", entropy(o->hist, o->n));
+			else
+				printf("        ");
+			printf(" %6.3f %-5s", pairs ? (double)o->changes / pairs : 0.0, mono);
+			for (k = 0; k < FIELDS; k++) {
+				double r = corr_r(&o->corr[k]);
+
+				if (isnan(r))
+					printf("       -");
+				else
+					printf(" %7.3f", r);
+			}
+			printf("\n");
+		}
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct work *work;
+	pthread_t *threads;
+	int i, t;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	inputs = calloc(argc, sizeof(*inputs));
+	if (!inputs) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "threads=", 8))
+			nthreads = atoi(argv[i] + 8);
+		else
+			inputs[ninputs++].path = argv[i];
+	}
+
+	if (!ninputs || (nthreads < 1) || !strcmp(argv[1], "--help")) {
+		fprintf(stderr, "Usage: %s [threads=n] dump... (- for stdin)\n"
+			"analyzes the output of read-gps noprocess\n", argv[0]);
+		return 1;
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	work = calloc(nthreads, sizeof(*work));
+	if (!threads || !work) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (t = 0; t < nthreads; t++)
+		pthread_create(&threads[t], NULL, parse_thread, NULL);
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+
+	/* sample order is input order */
+	for (i = 0; i < ninputs; i++) {
+		size_t j;
+
+		for (j = 0; j < inputs[i].count; j++) {
+			const struct sample *s = &inputs[i].samples[j];
+
+			groups[s->group].count++;
+			if (s->len > groups[s->group].maxlen)
+				groups[s->group].maxlen = s->len < MAX_OFFSETS ? s->len : MAX_OFFSETS;
+		}
+	}
+	for (i = 0; i < GROUPS; i++) {
+		if (!groups[i].count)
+			continue;
+
+		groups[i].samples = xrealloc(NULL, groups[i].count * sizeof(groups[i].samples[0]));
+		groups[i].data = xrealloc(NULL, groups[i].count * sizeof(groups[i].data[0]));
+		groups[i].count = 0;
+	}
+	for (i = 0; i < ninputs; i++) {
+		size_t j;
+
+		for (j = 0; j < inputs[i].count; j++) {
+			const struct sample *s = &inputs[i].samples[j];
+			size_t n = groups[s->group].count++;
+
+			groups[s->group].samples[n] = s;
+			groups[s->group].data[n] = inputs[i].data + s->data;
+		}
+	}
+	for (i = 0; i < GROUPS; i++)
+		if (groups[i].count && (i & 1))
+			sort_by_key(i);
+
+	for (t = 0; t < nthreads; t++) {
+		work[t].index = t;
+		pthread_create(&threads[t], NULL, analyze_thread, &work[t]);
+	}
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+
+	/* merged in thread order, which is sample order */
+	for (i = 0; i < GROUPS; i++) {
+		struct group_stats *g = work[0].stats[i];
+		unsigned int off;
+		int w;
+
+		if (!g)
+			continue;
+
+		for (t = 1; t < nthreads; t++) {
+			for (w = 0; w < WIDTHS; w++)
+				for (off = 0; off < g->maxlen; off++)
+					stats_merge(&g->off[w][off], &work[t].stats[i]->off[w][off]);
+			group_stats_free(work[t].stats[i]);
+			free(work[t].stats[i]);
+		}
+		print_group(i, g);
+		group_stats_free(g);
+		free(g);
+	}
+
+	return 0;
+}
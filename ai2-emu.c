@@ -0,0 +1,1171 @@
+// SPDX-License-Identifier: MIT
+/*
+ * ai2-emu - pretend to be a TI AI2 GPS receiver on a pty,
+ * so read-gps can be run and benchmarked without a BT-200
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <math.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "ai2.h"
+
+static double rate = 1;
+static unsigned int sats = 8;
+static bool nmea_enabled;
+static int state = RECEIVER_STATE_OFF;
+static unsigned long max_epochs;
+static const char *link_path;
+static uint64_t next_epoch;
+
+/* error injection, probabilities per frame */
+static double p_corrupt;
+static double p_drop;
+static double p_garbage;
+static double p_noack;
+static double p_error;
+
+static struct {
+	unsigned long epochs;
+	unsigned long frames;
+	unsigned long bytes;
+	unsigned long commands;
+	unsigned long bad_commands;
+	unsigned long acks;
+	unsigned long corrupted;
+	unsigned long dropped;
+	unsigned long garbage;
+	unsigned long noacks;
+	unsigned long errors;
+} stats;
+
+static volatile sig_atomic_t quit;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+static bool chance(double p)
+{
+	return (p > 0) && (drand48() < p);
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("write");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* the unescaped frame being built */
+static uint8_t body[65536];
+static size_t bodylen;
+
+static void frame_begin(uint8_t class)
+{
+	body[0] = 0x10;
+	body[1] = class;
+	bodylen = 2;
+}
+
+static void frame_add(uint8_t type, const void *data, size_t len)
+{
+	if (bodylen + 3 + len + 2 > sizeof(body))
+		return;
+
+	body[bodylen++] = type;
+	body[bodylen++] = len & 0xff;
+	body[bodylen++] = len >> 8;
+	memcpy(body + bodylen, data, len);
+	bodylen += len;
+}
+
+static void frame_send(int fd)
+{
+	static uint8_t out[2 * sizeof(body) + 64];
+	uint16_t sum = 0;
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < bodylen; i++)
+		sum += body[i];
+
+	if (chance(p_corrupt)) {
+		sum ^= 0x5a5a;
+		stats.corrupted++;
+	}
+	body[bodylen++] = sum & 0xff;
+	body[bodylen++] = sum >> 8;
+
+	if (chance(p_garbage)) {
+		int garbage = 1 + lrand48() % 16;
+
+		while (garbage--)
+			out[n++] = lrand48();
+
+		stats.garbage++;
+	}
+
+	out[n++] = 0x10;
+	for (i = 1; i < bodylen; i++) {
+		out[n++] = body[i];
+		if (body[i] == 0x10)
+			out[n++] = 0x10;
+	}
+	out[n++] = 0x10;
+	out[n++] = 0x03;
+
+	if (chance(p_drop)) {
+		size_t pos = lrand48() % n;
+
+		memmove(out + pos, out + pos + 1, n - pos - 1);
+		n--;
+		stats.dropped++;
+	}
+
+	write_all(fd, out, n);
+	stats.frames++;
+	stats.bytes += n;
+}
+
+static void send_ack(int fd)
+{
+	frame_begin(AI2_CLASS_ACK);
+	frame_send(fd);
+	stats.acks++;
+}
+
+static void send_error(int fd, uint16_t code)
+{
+	uint8_t err[2] = { code & 0xff, code >> 8 };
+
+	frame_begin(AI2_CLASS_NOACK);
+	frame_add(AI2_ERROR, err, sizeof(err));
+	frame_send(fd);
+	stats.errors++;
+}
+
+static void send_event(int fd, uint8_t event)
+{
+	frame_begin(AI2_CLASS_NOACK);
+	frame_add(AI2_ASYNC_EVENT, &event, 1);
+	frame_send(fd);
+}
+
+static int nmea_sentence(char *dest, size_t size, const char *body)
+{
+	uint8_t cs = 0;
+	const char *p;
+
+	for (p = body; *p; p++)
+		cs ^= *p;
+
+	return snprintf(dest, size, "$%s*%02X\r\n", body, cs);
+}
+
+/* dddmm.mmmm, in integers so it fits and 59.99999 does not round to 60 */
+static void nmea_coord(char *dest, size_t size, double deg, int width)
+{
+	unsigned long m = lround(fmin(fabs(deg), 180) * 600000);
+
+	snprintf(dest, size, "%0*lu%02lu.%04lu", width, m / 600000,
+		 m / 10000 % 60, m % 10000);
+}
+
+/* a slow circle around somewhere in Bavaria */
+static void track_position(unsigned long epoch, double *lat, double *lon)
+{
+	double angle = epoch * 0.01;
+
+	*lat = 48.1 + 0.001 * sin(angle);
+	*lon = 11.5 + 0.001 * cos(angle);
+}
+
+static void send_epoch(int fd, uint32_t fcount)
+{
+	static uint8_t buf[32768];
+	struct measurement_sv *m = (struct measurement_sv *)buf;
+	struct position *p = (struct position *)buf;
+	struct position_ext *pe = (struct position_ext *)buf;
+	struct nmea *n = (struct nmea *)buf;
+	double lat, lon;
+	size_t len;
+	unsigned int i;
+
+	track_position(stats.epochs, &lat, &lon);
+
+	frame_begin(AI2_CLASS_NOACK);
+	memset(buf, 0, sizeof(buf));
+	m->fcount = fcount;
+	for (i = 0; i < sats; i++) {
+		m->svdata[i].sv = i + 1;
+		m->svdata[i].snr = 250 + lrand48() % 200;
+		m->svdata[i].cno = 300 + lrand48() % 200;
+	}
+	frame_add(AI2_MEASUREMENT, buf, offsetof(struct measurement_sv, svdata) + sats * sizeof(m->svdata[0]));
+
+	memset(buf, 0, sizeof(buf));
+	p->fcount = fcount;
+	p->lat = lat / 90 * 2147483648.0;
+	p->lon = lon / 180 * 2147483648.0;
+	p->altitude = 500 * 2;
+	for (i = 0; i < sats; i++)
+		p->svdata[i].sv = i + 1;
+	frame_add(AI2_POSITION, buf, offsetof(struct position, svdata) + sats * sizeof(p->svdata[0]));
+	frame_send(fd);
+
+	frame_begin(AI2_CLASS_NOACK);
+	memset(buf, 0, sizeof(buf));
+	pe->fcount = fcount;
+	pe->lat = lat / 90 * 2147483648.0;
+	pe->lon = lon / 180 * 2147483648.0;
+	for (i = 0; i < sats; i++)
+		pe->svdata[i].sv = i + 1;
+	frame_add(AI2_POSITION_EXT, buf, offsetof(struct position_ext, svdata) + sats * sizeof(pe->svdata[0]));
+
+	if (nmea_enabled) {
+		char sentence[128], slat[24], slon[24];
+		struct timespec ts;
+		struct tm tm;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		gmtime_r(&ts.tv_sec, &tm);
+		nmea_coord(slat, sizeof(slat), lat, 2);
+		nmea_coord(slon, sizeof(slon), lon, 3);
+		n->fcount = fcount;
+		len = offsetof(struct nmea, nmea);
+		snprintf(sentence, sizeof(sentence),
+			 "GPGGA,%02d%02d%02d.%02ld,%s,N,%s,E,1,%02u,1.0,500.0,M,47.0,M,,",
+			 tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 10000000,
+			 slat, slon, sats);
+		len += nmea_sentence(n->nmea + len - offsetof(struct nmea, nmea),
+				     sizeof(buf) - len, sentence);
+		snprintf(sentence, sizeof(sentence),
+			 "GPRMC,%02d%02d%02d.%02ld,A,%s,N,%s,E,0.0,0.0,%02d%02d%02d,,,A",
+			 tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 10000000,
+			 slat, slon, tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+		len += nmea_sentence(n->nmea + len - offsetof(struct nmea, nmea),
+				     sizeof(buf) - len, sentence);
+		/* satellites in view, four per sentence, so bursts grow with sats */
+		for (i = 0; i < sats; i += 4) {
+			unsigned int j;
+			int l;
+
+			l = snprintf(sentence, sizeof(sentence), "GPGSV,%u,%u,%02u",
+				     (sats + 3) / 4, i / 4 + 1, sats);
+			for (j = i; (j < i + 4) && (j < sats); j++)
+				l += snprintf(sentence + l, sizeof(sentence) - l,
+					      ",%02u,%02u,%03u,%02u", j + 1,
+					      (j * 7) % 90, (j * 37) % 360, 30 + j % 20);
+			len += nmea_sentence(n->nmea + len - offsetof(struct nmea, nmea),
+					     sizeof(buf) - len, sentence);
+		}
+		frame_add(AI2_NMEA, buf, len);
+	}
+	frame_send(fd);
+	stats.epochs++;
+}
+
+static void handle_command(int fd, const uint8_t *buf, size_t len)
+{
+	uint16_t sum = 0;
+	uint16_t chk;
+	uint8_t class;
+	size_t i;
+
+	stats.commands++;
+	if (len < 4) {
+		stats.bad_commands++;
+		return;
+	}
+
+	chk = buf[len - 2] | (buf[len - 1] << 8);
+	len -= 2;
+	for (i = 0; i < len; i++)
+		sum += buf[i];
+
+	if (sum != chk) {
+		stats.bad_commands++;
+		send_error(fd, 0x02ff);
+		return;
+	}
+
+	class = buf[1];
+	if (class == AI2_CLASS_ACKREQ) {
+		if (chance(p_error)) {
+			send_error(fd, 0x0101);
+			return;
+		}
+
+		if (chance(p_noack))
+			stats.noacks++;
+		else
+			send_ack(fd);
+	}
+
+	buf += 2;
+	len -= 2;
+	while (len >= 3) {
+		uint8_t cmd = buf[0];
+		uint16_t sublen = buf[1] | (buf[2] << 8);
+
+		buf += 3;
+		len -= 3;
+		if (len < sublen)
+			break;
+
+		if ((cmd == AI2_CMD_RECEIVER_STATE) && sublen) {
+			if ((buf[0] == RECEIVER_STATE_ON) && (state != RECEIVER_STATE_ON))
+				next_epoch = now_ns();
+
+			state = buf[0];
+			if (state == RECEIVER_STATE_IDLE)
+				send_event(fd, AI2_ASYNC_EVENT_ENG_IDLE);
+			else if (state == RECEIVER_STATE_OFF)
+				send_event(fd, AI2_ASYNC_EVENT_ENG_OFF);
+		}
+
+		if ((cmd == AI2_CMD_NMEA_REPORTS) && sublen)
+			nmea_enabled = buf[0] != 0;
+
+		buf += sublen;
+		len -= sublen;
+	}
+}
+
+/* collects commands from the host, unescaping them on the way */
+static void read_commands(int fd)
+{
+	static uint8_t cmd[4096];
+	static size_t cmdlen;
+	static bool escaping;
+	uint8_t buf[1024];
+	ssize_t ret;
+	ssize_t i;
+
+	ret = read(fd, buf, sizeof(buf));
+	if (ret <= 0)
+		return;
+
+	for (i = 0; i < ret; i++) {
+		uint8_t c = buf[i];
+
+		if (!cmdlen) {
+			if (c == 0x10) {
+				cmd[0] = c;
+				cmdlen = 1;
+				escaping = false;
+			}
+			continue;
+		}
+
+		if (escaping) {
+			escaping = false;
+			if (c == 3) {
+				handle_command(fd, cmd, cmdlen);
+				cmdlen = 0;
+				continue;
+			}
+		} else if (c == 0x10) {
+			escaping = true;
+			continue;
+		}
+
+		if (cmdlen == sizeof(cmd)) {
+			cmdlen = 0;
+			continue;
+		}
+		cmd[cmdlen++] = c;
+	}
+}
+
+static int open_pty(int *slave, const char **ptyname)
+{
+	struct termios tio;
+	char *name;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((fd < 0) || grantpt(fd) || unlockpt(fd)) {
+		perror("posix_openpt");
+		return -1;
+	}
+
+	name = ptsname(fd);
+	/* keep one end open so the host can come and go */
+	*slave = open(name, O_RDWR | O_NOCTTY);
+	if (*slave < 0) {
+		perror(name);
+		return -1;
+	}
+
+	tcgetattr(*slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(*slave, TCSANOW, &tio);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(name, link_path)) {
+			perror(link_path);
+			return -1;
+		}
+		name = (char *)link_path;
+	}
+
+	/* ptsname() reuses its buffer */
+	*ptyname = strdup(name);
+	return fd;
+}
+
+
+static void print_stats(void)
+{
+	fprintf(stderr, "ai2-emu: epochs: %lu frames: %lu bytes: %lu commands: %lu bad: %lu acks: %lu\n",
+		stats.epochs, stats.frames, stats.bytes, stats.commands,
+		stats.bad_commands, stats.acks);
+	fprintf(stderr, "ai2-emu: injected: corrupt: %lu dropped: %lu garbage: %lu noack: %lu errors: %lu\n",
+		stats.corrupted, stats.dropped, stats.garbage, stats.noacks,
+		stats.errors);
+}
+
+static void handle_quit(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t interval;
+static uint32_t fcount;
+static uint32_t fcount_step;
+
+static void set_rate(double hz)
+{
+	rate = hz;
+	interval = 1e9 / rate;
+	fcount_step = 1000 / rate;
+	if (!fcount_step)
+		fcount_step = 1;
+}
+
+/*
+ * sends count epochs (0: forever) while the receiver is on and answers
+ * commands, the time each epoch was due is stored in sched if given
+ */
+static unsigned long emulate(int fd, unsigned long count, uint64_t *sched)
+{
+	unsigned long sent = 0;
+
+	while (!quit && (!count || (sent < count))) {
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN,
+		};
+		struct timespec ts;
+		uint64_t now = now_ns();
+		uint64_t timeout;
+
+		if (state == RECEIVER_STATE_ON) {
+			/* catch up when behind instead of drifting */
+			while ((next_epoch <= now) && (!count || (sent < count))) {
+				if (sched)
+					sched[sent] = next_epoch;
+				send_epoch(fd, fcount);
+				fcount += fcount_step;
+				next_epoch += interval;
+				sent++;
+			}
+			if (count && (sent == count))
+				break;
+
+			now = now_ns();
+			timeout = (next_epoch > now) ? next_epoch - now : 0;
+		} else {
+			timeout = 100000000;
+		}
+
+		ts.tv_sec = timeout / 1000000000;
+		ts.tv_nsec = timeout % 1000000000;
+		if (ppoll(&pfd, 1, &ts, NULL) > 0)
+			read_commands(fd);
+	}
+
+	return sent;
+}
+
+/*
+ * Load test: read-gps is run on the pty with its output going to a
+ * second pty, so it is line buffered like on a terminal. Every epoch
+ * is matched by fcount against the position and position_ext lines
+ * printed for it. Each step runs for a while at a fixed rate and
+ * satellite count, the rate is doubled until read-gps does not keep
+ * up anymore, then the next satellite count is tried.
+ */
+#define MAX_SAT_STEPS 16
+
+static unsigned int sat_steps[MAX_SAT_STEPS] = { 8, 32, 128, 255 };
+static int num_sat_steps = 4;
+static const char *loadtest;
+static double steptime = 3;
+static double maxlat_ms = 100;
+static double maxrate = 100000;
+
+struct loadtest_step {
+	pthread_mutex_t lock;
+	uint32_t first_fcount;
+	uint32_t fcount_step;
+	unsigned long count;
+	uint64_t *sched;
+	/* arrival of the position and the position_ext line */
+	uint64_t *seen[2];
+	unsigned long lines;
+};
+
+static struct loadtest_step step = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void loadtest_line(const char *line, uint64_t now)
+{
+	unsigned long idx;
+	unsigned int fc;
+	int ext;
+
+	if (sscanf(line, "position: fcount: %u,", &fc) != 1)
+		return;
+
+	ext = !strstr(line, "altitude:");
+	pthread_mutex_lock(&step.lock);
+	step.lines++;
+	idx = (uint32_t)(fc - step.first_fcount) / step.fcount_step;
+	if ((idx < step.count) && !step.seen[ext][idx])
+		step.seen[ext][idx] = now;
+	pthread_mutex_unlock(&step.lock);
+}
+
+static void *loadtest_reader(void *arg)
+{
+	static char buf[65536];
+	int fd = *(int *)arg;
+	size_t len = 0;
+
+	for (;;) {
+		ssize_t ret = read(fd, buf + len, sizeof(buf) - len - 1);
+		uint64_t now = now_ns();
+		char *line = buf;
+		char *nl;
+
+		if (ret <= 0) {
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+
+			return NULL;
+		}
+
+		len += ret;
+		buf[len] = 0;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = 0;
+			loadtest_line(line, now);
+			line = nl + 1;
+		}
+
+		len -= line - buf;
+		/* overlong line, nothing of interest in there */
+		if (len == sizeof(buf) - 1)
+			len = 0;
+		memmove(buf, line, len);
+	}
+}
+
+/* user and system time of the child in ns */
+static uint64_t child_cpu_ns(pid_t pid)
+{
+	unsigned long utime, stime;
+	char path[64];
+	char *p;
+	char statbuf[1024];
+	FILE *f;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	n = fread(statbuf, 1, sizeof(statbuf) - 1, f);
+	fclose(f);
+	statbuf[n] = 0;
+	/* the command name may contain anything, skip past it */
+	p = strrchr(statbuf, ')');
+	if (!p || (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			  &utime, &stime) != 2))
+		return 0;
+
+	return (utime + stime) * (1000000000ull / sysconf(_SC_CLK_TCK));
+}
+
+static pid_t spawn_reader(const char *prog, const char *dev, int *out, char **args, int nargs)
+{
+	const char *defargs[] = { "positions" };
+	struct termios tio;
+	char *argv[nargs + 3];
+	const char *name;
+	pid_t pid;
+	int i;
+
+	*out = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((*out < 0) || grantpt(*out) || unlockpt(*out)) {
+		perror("posix_openpt");
+		return -1;
+	}
+	name = ptsname(*out);
+
+	argv[0] = (char *)prog;
+	argv[1] = (char *)dev;
+	if (!nargs) {
+		args = (char **)defargs;
+		nargs = 1;
+	}
+	for (i = 0; i < nargs; i++)
+		argv[i + 2] = args[i];
+	argv[nargs + 2] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		int tty = open(name, O_RDWR | O_NOCTTY);
+		int null = open("/dev/null", O_WRONLY);
+
+		if ((tty < 0) || (null < 0))
+			_exit(127);
+
+		tcgetattr(tty, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(tty, TCSANOW, &tio);
+		dup2(tty, 1);
+		dup2(null, 2);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned long n, double p)
+{
+	if (!n)
+		return 0;
+
+	return sorted[(unsigned long)((n - 1) * p)] / 1e3;
+}
+
+/* runs one step, prints it as JSON and returns whether read-gps kept up */
+static bool loadtest_step(int fd, pid_t pid, double hz, unsigned int nsats, bool first)
+{
+	unsigned long count = hz * steptime;
+	uint64_t *lat;
+	uint64_t start, sent_ns, cpu, emu_cpu;
+	uint64_t bytes, lines;
+	unsigned long seen, lost, n, i;
+	double achieved, loss, cpu_load, emu_load;
+	bool ok;
+
+	if (count < 10)
+		count = 10;
+
+	sats = nsats;
+	set_rate(hz);
+	lat = calloc(count, sizeof(*lat));
+	pthread_mutex_lock(&step.lock);
+	step.first_fcount = fcount;
+	step.fcount_step = fcount_step;
+	step.count = count;
+	step.sched = calloc(count, sizeof(uint64_t));
+	step.seen[0] = calloc(count, sizeof(uint64_t));
+	step.seen[1] = calloc(count, sizeof(uint64_t));
+	step.lines = 0;
+	pthread_mutex_unlock(&step.lock);
+	if (!lat || !step.sched || !step.seen[0] || !step.seen[1]) {
+		perror("calloc");
+		exit(1);
+	}
+
+	bytes = stats.bytes;
+	cpu = child_cpu_ns(pid);
+	emu_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	start = now_ns();
+	next_epoch = start;
+	emulate(fd, count, step.sched);
+	sent_ns = now_ns() - start;
+	emu_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - emu_cpu;
+	bytes = stats.bytes - bytes;
+
+	/* give read-gps a moment to catch up with what is still queued */
+	for (;;) {
+		pthread_mutex_lock(&step.lock);
+		for (seen = 0, i = 0; i < count; i++)
+			seen += step.seen[0][i] && step.seen[1][i];
+		pthread_mutex_unlock(&step.lock);
+
+		if ((seen == count) || quit ||
+		    (now_ns() - start - sent_ns > (maxlat_ms * 1e6 + 1e9)))
+			break;
+
+		usleep(10000);
+	}
+	cpu = child_cpu_ns(pid) - cpu;
+
+	pthread_mutex_lock(&step.lock);
+	for (n = 0, i = 0; i < count; i++) {
+		if (step.seen[0][i] && step.seen[1][i]) {
+			uint64_t done = step.seen[0][i] > step.seen[1][i] ? step.seen[0][i] : step.seen[1][i];
+
+			lat[n++] = (done > step.sched[i]) ? done - step.sched[i] : 0;
+		}
+	}
+	lines = step.lines;
+	step.count = 0;
+	free(step.sched);
+	free(step.seen[0]);
+	free(step.seen[1]);
+	pthread_mutex_unlock(&step.lock);
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	lost = count - n;
+	loss = (double)lost / count;
+	achieved = count / (sent_ns / 1e9);
+	cpu_load = (double)cpu / sent_ns;
+	/* when this gets close to 1, the emulator is the bottleneck */
+	emu_load = (double)emu_cpu / sent_ns;
+	ok = !lost && (achieved >= 0.95 * hz) &&
+	     (percentile_us(lat, n, 0.99) <= maxlat_ms * 1e3);
+
+	printf("%s\n    {\"sats\": %u, \"rate\": %.1f, \"epochs\": %lu, \"achieved_rate\": %.1f, "
+	       "\"frame_rate\": %.1f, \"bytes_per_s\": %.0f, \"lines\": %" PRIu64 ", "
+	       "\"lost\": %lu, \"loss\": %.4f, "
+	       "\"latency_us\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f}, "
+	       "\"reader_cpu\": %.3f, \"emulator_cpu\": %.3f, \"sustained\": %s}",
+	       first ? "" : ",", nsats, hz, count, achieved, 2 * achieved,
+	       bytes / (sent_ns / 1e9), lines, lost, loss,
+	       percentile_us(lat, n, 0.5), percentile_us(lat, n, 0.9),
+	       percentile_us(lat, n, 0.99), percentile_us(lat, n, 1),
+	       cpu_load, emu_load, ok ? "true" : "false");
+	fflush(stdout);
+	fprintf(stderr, "ai2-emu: sats %u rate %.0f/s: achieved %.0f/s lost %lu p99 %.0fus cpu %.1f%% (emulator %.1f%%)%s\n",
+		nsats, hz, achieved, lost, percentile_us(lat, n, 0.99),
+		cpu_load * 100, emu_load * 100, ok ? "" : " saturated");
+	free(lat);
+	return ok;
+}
+
+/*
+ * read-gps initializes the receiver and switches it on, give it
+ * a second more in case that was not the last command
+ */
+static int wait_for_on(int fd, pid_t pid, const char *prog)
+{
+	uint64_t deadline = now_ns() + 10000000000ull;
+
+	while (!quit && (now_ns() < deadline)) {
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN,
+		};
+
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			break;
+
+		if (poll(&pfd, 1, 100) > 0)
+			read_commands(fd);
+
+		if ((state == RECEIVER_STATE_ON) && (deadline > now_ns() + 1000000000ull))
+			deadline = now_ns() + 1000000000ull;
+	}
+
+	if (state != RECEIVER_STATE_ON) {
+		fprintf(stderr, "%s did not switch the receiver on\n", prog);
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	return 0;
+}
+
+static int run_loadtest(int fd, const char *dev, char **args, int nargs)
+{
+	double best[MAX_SAT_STEPS] = { 0 };
+	double start_rate = rate;
+	pthread_t thread;
+	bool first = true;
+	pid_t pid;
+	int out;
+	int i;
+
+	pid = spawn_reader(loadtest, dev, &out, args, nargs);
+	if (pid < 0)
+		return 1;
+
+	pthread_create(&thread, NULL, loadtest_reader, &out);
+
+	if (wait_for_on(fd, pid, loadtest))
+		return 1;
+
+	printf("{\n  \"reader\": \"%s\", \"steptime\": %.1f, \"maxlat_ms\": %.1f, \"nmea\": %s,\n  \"steps\": [",
+	       loadtest, steptime, maxlat_ms, nmea_enabled ? "true" : "false");
+	for (i = 0; (i < num_sat_steps) && !quit; i++) {
+		double hz;
+
+		for (hz = start_rate; (hz <= maxrate) && !quit; hz *= 2) {
+			bool ok = loadtest_step(fd, pid, hz, sat_steps[i], first);
+
+			first = false;
+			if (waitpid(pid, NULL, WNOHANG) == pid) {
+				fprintf(stderr, "%s exited\n", loadtest);
+				quit = 1;
+			}
+			if (!ok)
+				break;
+
+			best[i] = hz;
+		}
+	}
+
+	printf("\n  ],\n  \"max_sustained\": [");
+	for (i = 0; i < num_sat_steps; i++)
+		printf("%s\n    {\"sats\": %u, \"rate\": %.1f, \"frame_rate\": %.1f}",
+		       i ? "," : "", sat_steps[i], best[i], 2 * best[i]);
+	printf("\n  ]\n}\n");
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
+
+/*
+ * Check: read-gps is run on the pty, left in the cooked mode of a
+ * fresh tty, and sent frames full of what such a tty eats or mangles:
+ * 0x03 (^C), 0x0d (CR), 0x0a (NL), 0x11 and 0x13 (XON and XOFF),
+ * next to every other byte value. They have to come back unmodified
+ * as the hex dump of an unknown packet.
+ */
+#define CHECK_TYPE 0xfe
+#define CHECK_PAYLOADS 2
+
+static const char *check;
+
+static size_t check_payload(int i, uint8_t *p)
+{
+	static const uint8_t ctrl[] = { 0x03, 0x0d, 0x11, 0x13, 0x0a, 0x10, 0x03, 0x7f };
+	size_t n;
+
+	if (!i) {
+		for (n = 0; n < 256; n++)
+			p[n] = n;
+		return n;
+	}
+
+	for (n = 0; n < 8 * sizeof(ctrl); n++)
+		p[n] = ctrl[n % sizeof(ctrl)];
+	return n;
+}
+
+static void check_tty_cooked(int slave)
+{
+	struct termios tio;
+
+	tcgetattr(slave, &tio);
+	tio.c_iflag |= ICRNL | IXON;
+	tio.c_oflag |= OPOST | ONLCR;
+	tio.c_lflag |= ICANON | ISIG | IEXTEN;
+	tcsetattr(slave, TCSANOW, &tio);
+}
+
+static int run_check(int fd, const char *dev, char **args, int nargs)
+{
+	char *argv[nargs + 1];
+	char want[CHECK_PAYLOADS][600];
+	bool seen[CHECK_PAYLOADS] = { false };
+	static char buf[65536];
+	uint8_t payload[512];
+	uint64_t deadline;
+	size_t len = 0;
+	int found = 0;
+	pid_t pid;
+	int out;
+	int i;
+
+	argv[0] = "hexunknown";
+	for (i = 0; i < nargs; i++)
+		argv[i + 1] = args[i];
+
+	pid = spawn_reader(check, dev, &out, argv, nargs + 1);
+	if (pid < 0)
+		return 1;
+
+	if (wait_for_on(fd, pid, check))
+		return 1;
+
+	for (i = 0; i < CHECK_PAYLOADS; i++) {
+		size_t n = check_payload(i, payload);
+		char *p = want[i];
+		size_t j;
+
+		p += sprintf(p, "unknown packet type %x len: %zu ", CHECK_TYPE, n);
+		for (j = 0; j < n; j++)
+			p += sprintf(p, "%02x", payload[j]);
+
+		frame_begin(AI2_CLASS_NOACK);
+		frame_add(CHECK_TYPE, payload, n);
+		frame_send(fd);
+	}
+
+	deadline = now_ns() + 2000000000ull;
+	while (!quit && (found < CHECK_PAYLOADS) && (now_ns() < deadline)) {
+		struct pollfd pfd = {
+			.fd = out,
+			.events = POLLIN,
+		};
+		char *line = buf;
+		char *nl;
+		ssize_t ret;
+
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		ret = read(out, buf + len, sizeof(buf) - len - 1);
+		if (ret <= 0)
+			break;
+
+		len += ret;
+		buf[len] = 0;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = 0;
+			if ((nl > line) && (nl[-1] == '\r'))
+				nl[-1] = 0;
+			for (i = 0; i < CHECK_PAYLOADS; i++) {
+				if (!seen[i] && !strcmp(line, want[i])) {
+					seen[i] = true;
+					found++;
+				}
+			}
+			line = nl + 1;
+		}
+		len -= line - buf;
+		if (len == sizeof(buf) - 1)
+			len = 0;
+		memmove(buf, line, len);
+	}
+
+	/* a second for writing out everything, then it is stuck */
+	kill(pid, SIGTERM);
+	for (i = 0; (i < 20) && (waitpid(pid, NULL, WNOHANG) != pid); i++)
+		usleep(50000);
+	if (i == 20) {
+		fprintf(stderr, "check: %s did not exit on SIGTERM\n", check);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return 1;
+	}
+
+	for (i = 0; i < CHECK_PAYLOADS; i++)
+		if (!seen[i])
+			fprintf(stderr, "check: payload %d did not arrive unmodified\n", i);
+
+	if (found < CHECK_PAYLOADS)
+		return 1;
+
+	fprintf(stderr, "check: %s passed\n", check);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	bool rate_set = false;
+	const char *name;
+	int slave;
+	int fd;
+	int i, j;
+
+	if ((argc > 1) && !strcmp(argv[1], "--help")) {
+		fprintf(stderr, "Usage: %s [rate=hz] [sats=n[,n...]] [on] [nmea] [epochs=n] [link=path] [seed=n]\n"
+			"\t[corrupt=p] [drop=p] [garbage=p] [noack=p] [error=p]\n"
+			"\t[loadtest=read-gps] [steptime=s] [maxlat=ms] [maxrate=hz] [check=read-gps] [-- read-gps args]\n"
+			"creates a pty talking AI2 and prints its name\n",
+			argv[0]);
+		return 1;
+	}
+
+	srand48(time(NULL));
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+
+		if (!strncmp(argv[i], "rate=", 5)) {
+			rate = atof(argv[i] + 5);
+			rate_set = true;
+		}
+
+		if (!strncmp(argv[i], "sats=", 5)) {
+			char *p = argv[i] + 4;
+
+			num_sat_steps = 0;
+			do {
+				sat_steps[num_sat_steps++] = strtoul(p + 1, &p, 0);
+			} while ((*p == ',') && (num_sat_steps < MAX_SAT_STEPS));
+			sats = sat_steps[0];
+		}
+
+		if (!strcmp(argv[i], "on"))
+			state = RECEIVER_STATE_ON;
+
+		if (!strcmp(argv[i], "nmea"))
+			nmea_enabled = true;
+
+		if (!strncmp(argv[i], "epochs=", 7))
+			max_epochs = strtoul(argv[i] + 7, NULL, 0);
+
+		if (!strncmp(argv[i], "link=", 5))
+			link_path = argv[i] + 5;
+
+		if (!strncmp(argv[i], "seed=", 5))
+			srand48(strtol(argv[i] + 5, NULL, 0));
+
+		if (!strncmp(argv[i], "corrupt=", 8))
+			p_corrupt = atof(argv[i] + 8);
+
+		if (!strncmp(argv[i], "drop=", 5))
+			p_drop = atof(argv[i] + 5);
+
+		if (!strncmp(argv[i], "garbage=", 8))
+			p_garbage = atof(argv[i] + 8);
+
+		if (!strncmp(argv[i], "noack=", 6))
+			p_noack = atof(argv[i] + 6);
+
+		if (!strncmp(argv[i], "error=", 6))
+			p_error = atof(argv[i] + 6);
+
+		if (!strncmp(argv[i], "loadtest=", 9))
+			loadtest = argv[i] + 9;
+
+		if (!strncmp(argv[i], "check=", 6))
+			check = argv[i] + 6;
+
+		if (!strncmp(argv[i], "steptime=", 9))
+			steptime = atof(argv[i] + 9);
+
+		if (!strncmp(argv[i], "maxlat=", 7))
+			maxlat_ms = atof(argv[i] + 7);
+
+		if (!strncmp(argv[i], "maxrate=", 8))
+			maxrate = atof(argv[i] + 8);
+	}
+
+	if (loadtest) {
+		/* the NMEA bursts are part of the load */
+		nmea_enabled = true;
+		if (!rate_set)
+			rate = 10;
+	}
+
+	for (j = 0; j < num_sat_steps; j++) {
+		if (sat_steps[j] > 255) {
+			fprintf(stderr, "invalid satellite count\n");
+			return 1;
+		}
+	}
+
+	if ((rate <= 0) || (steptime <= 0)) {
+		fprintf(stderr, "invalid rate\n");
+		return 1;
+	}
+
+	fd = open_pty(&slave, &name);
+	if (fd < 0)
+		return 1;
+
+	signal(SIGINT, handle_quit);
+	signal(SIGTERM, handle_quit);
+	signal(SIGPIPE, SIG_IGN);
+
+	set_rate(rate);
+	fcount = lrand48();
+	next_epoch = now_ns();
+	if (check) {
+		int ret;
+
+		check_tty_cooked(slave);
+		ret = run_check(fd, name, argv + i, argc - i);
+		if (link_path)
+			unlink(link_path);
+
+		return ret;
+	}
+
+	if (loadtest) {
+		int ret = run_loadtest(fd, name, argv + i, argc - i);
+
+		print_stats();
+		if (link_path)
+			unlink(link_path);
+
+		return ret;
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+	emulate(fd, max_epochs, NULL);
+
+	print_stats();
+	if (link_path)
+		unlink(link_path);
+
+	close(fd);
+	close(slave);
+	return 0;
+}
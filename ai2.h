@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: MIT
+/*
+ * TI AI2 protocol definitions shared by read-gps and ai2-emu
+ */
+#ifndef AI2_H
+#define AI2_H
+
+#include <stdint.h>
+
+/*
+ * frames are 0x10 <class> { <type> <len16> <data> }* <sum16> 0x10 0x03
+ * with every 0x10 after the first one doubled, sum16 is the sum of
+ * all bytes before it
+ */
+#define AI2_CLASS_NOACK 0
+#define AI2_CLASS_ACKREQ 1
+#define AI2_CLASS_ACK 2
+
+/* we assume machine order = network order = le for simplity here */
+#define AI2_MEASUREMENT 8
+struct __attribute__((__packed__)) measurement_sv {
+	uint32_t fcount; /* probably ms since start of report */
+	struct __attribute__((__packed__)) {
+		uint8_t sv;
+		uint16_t snr;
+		uint16_t cno;
+		uint8_t unknown[23];
+	} svdata[];
+};
+
+#define AI2_POSITION 6
+struct __attribute__((__packed__)) position {
+	uint32_t fcount; /* probably ms since start of report */
+	uint16_t unknown1;
+	int32_t lat;
+	int32_t lon;
+	int16_t altitude;
+	uint8_t unknown2[15];
+	struct __attribute__((__packed__)) {
+		uint8_t sv;
+		uint8_t unknown[5];
+	} svdata[];
+};
+
+#define AI2_NMEA 0xd3
+struct __attribute__((__packed__)) nmea {
+	uint32_t fcount;
+	char nmea[];
+};
+
+#define AI2_POSITION_EXT 0xd5
+struct __attribute__((__packed__)) position_ext {
+	uint32_t fcount; /* probably ms since start of report */
+	uint16_t unknown1;
+	int32_t lat;
+	int32_t lon;
+	uint8_t unknown[47];
+	struct __attribute__((__packed__)) {
+		uint8_t sv;
+		uint8_t unknown[5];
+	} svdata[];
+};
+
+#define AI2_ASYNC_EVENT 0x80
+#define AI2_ASYNC_EVENT_ENG_IDLE 0x07
+#define AI2_ASYNC_EVENT_ENG_OFF 0x01
+
+#define AI2_ERROR 0xf5
+
+#define AI2_CMD_RECEIVER_STATE 2
+#define RECEIVER_STATE_OFF 1
+#define RECEIVER_STATE_IDLE 2
+#define RECEIVER_STATE_ON 3
+
+#define AI2_CMD_NMEA_REPORTS 0xe5
+#define NMEA_MASK_GGA (1 << 0)
+#define NMEA_MASK_GLL (1 << 1)
+#define NMEA_MASK_GSA (1 << 2)
+#define NMEA_MASK_GSV (1 << 3)
+#define NMEA_MASK_RMC (1 << 4)
+#define NMEA_MASK_VTG (1 << 5)
+
+#define NMEA_MASK_ALL (NMEA_MASK_GGA | NMEA_MASK_GLL | NMEA_MASK_GSA | NMEA_MASK_GSV | NMEA_MASK_RMC | NMEA_MASK_VTG)
+
+#endif
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: MIT
+/*
+ * columnar archive of decoded epochs, written by read-gps archive=
+ * and read by read-archive
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * file: archive_header { block }*
+ * block: archive_block { archive_column data }*
+ * data is zlib compressed, uncompressed it is the column's values as
+ * varints of the zig-zag encoded difference to the previous value in
+ * the block (the first one to 0). Per epoch columns have a value per
+ * row, per sv columns nsv values per row. min and max are those of
+ * the values, so readers can skip blocks without decompressing them.
+ * For lat, lon and alt they only cover the rows whose flags say the
+ * epoch had them, the others store 0.
+ * Integers are little endian like everything in ai2.h.
+ */
+#define ARCHIVE_MAGIC "AI2A"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_ROWS 4096
+
+enum {
+	ARCHIVE_FCOUNT,
+	ARCHIVE_TIME, /* CLOCK_REALTIME ns of arrival */
+	ARCHIVE_FLAGS,
+	ARCHIVE_LAT, /* as in struct position */
+	ARCHIVE_LON,
+	ARCHIVE_ALT,
+	ARCHIVE_NSV,
+	/* per sv from here on, from struct measurement_sv */
+	ARCHIVE_SV,
+	ARCHIVE_SNR,
+	ARCHIVE_CNO,
+	ARCHIVE_COLUMNS,
+};
+
+#define ARCHIVE_FIRST_SV_COLUMN ARCHIVE_SV
+
+/* what the epoch had */
+#define ARCHIVE_FLAG_POSITION 1
+#define ARCHIVE_FLAG_MEASUREMENT 2
+#define ARCHIVE_FLAG_ALTITUDE 4 /* position_ext has none */
+
+struct __attribute__((__packed__)) archive_header {
+	char magic[4];
+	uint32_t version;
+};
+
+struct __attribute__((__packed__)) archive_block {
+	uint32_t rows;
+	uint32_t svs;
+	uint32_t columns;
+};
+
+struct __attribute__((__packed__)) archive_column {
+	uint32_t id;
+	uint32_t rawlen;
+	uint32_t len;
+	int64_t min;
+	int64_t max;
+};
+
+/* flag a row needs for the column to hold a value, 0 if always */
+static inline unsigned int archive_column_flag(int column)
+{
+	switch (column) {
+	case ARCHIVE_LAT:
+	case ARCHIVE_LON:
+		return ARCHIVE_FLAG_POSITION;
+	case ARCHIVE_ALT:
+		return ARCHIVE_FLAG_ALTITUDE;
+	default:
+		return 0;
+	}
+}
+
+static inline uint64_t zigzag_encode(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* at most 10 bytes */
+static inline uint8_t *varint_encode(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* NULL if truncated */
+static inline const uint8_t *varint_decode(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while ((p < end) && (shift < 64)) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: MIT
+/*
+ * binary records written by read-gps binout=
+ *
+ * Every record is GPS_RECORD_SIZE bytes with all fields naturally
+ * aligned, so a file can be mmapped and used as an array of struct
+ * gps_record, or a stream read in chunks of GPS_RECORD_SIZE. The first
+ * record is of type GPS_RECORD_FILE. Readers must skip record types
+ * they do not know, fields are only ever added into the padding with
+ * a new version. Everything is in host byte order.
+ */
+#ifndef GPS_RECORD_H
+#define GPS_RECORD_H
+
+#include <stdint.h>
+
+#define GPS_RECORD_MAGIC "AI2R"
+#define GPS_RECORD_VERSION 1
+#define GPS_RECORD_SIZE 64
+
+enum {
+	GPS_RECORD_FILE,
+	/* from a position or position_ext report */
+	GPS_RECORD_POSITION,
+	/* from a measurement report, followed by nsv GPS_RECORD_SV */
+	GPS_RECORD_MEASUREMENT,
+	GPS_RECORD_SV,
+};
+
+/* position has altitude */
+#define GPS_RECORD_FLAG_ALT 1
+
+struct gps_record {
+	uint16_t type;
+	uint16_t version;
+	uint32_t fcount;
+	/* CLOCK_REALTIME of arrival */
+	uint64_t time_ns;
+	union {
+		struct {
+			char magic[4];
+			uint32_t size;
+		} file;
+		struct {
+			double lat; /* degrees */
+			double lon;
+			double alt; /* meters */
+			uint32_t flags;
+			uint32_t nsv;
+		} position;
+		struct {
+			uint32_t nsv;
+		} measurement;
+		struct {
+			uint32_t sv;
+			uint32_t index; /* within the measurement */
+			float snr; /* dB */
+			float cno; /* dB-Hz */
+		} sv;
+		uint8_t pad[GPS_RECORD_SIZE - 16];
+	};
+};
+
+_Static_assert(sizeof(struct gps_record) == GPS_RECORD_SIZE, "gps_record size");
+
+#endif
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: MIT
+/*
+ * read-archive - print the epochs of a read-gps archive= file,
+ * decoding only the columns asked for
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+#include "archive.h"
+
+static const struct {
+	const char *name;
+	double scale;
+} columns[ARCHIVE_COLUMNS] = {
+	[ARCHIVE_FCOUNT] = { "fcount", 1 },
+	[ARCHIVE_TIME] = { "time", 1e-9 },
+	[ARCHIVE_FLAGS] = { "flags", 1 },
+	[ARCHIVE_LAT] = { "lat", 90 / 2147483648.0 },
+	[ARCHIVE_LON] = { "lon", 180 / 2147483648.0 },
+	[ARCHIVE_ALT] = { "alt", 0.5 },
+	[ARCHIVE_NSV] = { "nsv", 1 },
+	[ARCHIVE_SV] = { "sv", 1 },
+	[ARCHIVE_SNR] = { "snr", 0.1 },
+	[ARCHIVE_CNO] = { "cno", 0.1 },
+};
+
+static int selected[ARCHIVE_COLUMNS];
+static int nselected;
+static bool wanted[ARCHIVE_COLUMNS];
+
+#define MAX_RANGES 8
+static struct {
+	int column;
+	double min, max;
+} ranges[MAX_RANGES];
+static int nranges;
+
+static bool show_sizes;
+static struct {
+	unsigned long long values, rawlen, len;
+} sizes[ARCHIVE_COLUMNS];
+static unsigned long blocks, skipped;
+
+static int column_id(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < ARCHIVE_COLUMNS; i++)
+		if ((strlen(columns[i].name) == len) && !strncmp(columns[i].name, name, len))
+			return i;
+
+	return -1;
+}
+
+static int parse_columns(const char *list)
+{
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		int id = column_id(list, len);
+
+		if (id < 0) {
+			fprintf(stderr, "unknown column %.*s\n", (int)len, list);
+			return -1;
+		}
+		selected[nselected++] = id;
+		wanted[id] = true;
+		list += len;
+		if (*list == ',')
+			list++;
+		if (nselected == ARCHIVE_COLUMNS)
+			break;
+	}
+	return 0;
+}
+
+/* col:min:max in printed units */
+static int parse_range(const char *arg)
+{
+	const char *colon = strchr(arg, ':');
+	int id;
+
+	if (!colon || (nranges == MAX_RANGES))
+		return -1;
+
+	id = column_id(arg, colon - arg);
+	if ((id < 0) || (id >= ARCHIVE_FIRST_SV_COLUMN)) {
+		fprintf(stderr, "range needs a per epoch column\n");
+		return -1;
+	}
+
+	if (sscanf(colon + 1, "%lf:%lf", &ranges[nranges].min, &ranges[nranges].max) != 2)
+		return -1;
+
+	ranges[nranges].column = id;
+	wanted[id] = true;
+	if (archive_column_flag(id))
+		wanted[ARCHIVE_FLAGS] = true;
+	nranges++;
+	return 0;
+}
+
+static bool in_range(int column, double v)
+{
+	int i;
+
+	for (i = 0; i < nranges; i++)
+		if ((ranges[i].column == column) &&
+		    ((v < ranges[i].min) || (v > ranges[i].max)))
+			return false;
+
+	return true;
+}
+
+static bool overlaps(int column, int64_t min, int64_t max)
+{
+	int i;
+
+	for (i = 0; i < nranges; i++)
+		if ((ranges[i].column == column) &&
+		    ((max * columns[column].scale < ranges[i].min) ||
+		     (min * columns[column].scale > ranges[i].max)))
+			return false;
+
+	return true;
+}
+
+static int decode_column(const struct archive_column *col, const uint8_t *packed,
+			 int64_t *v, size_t count)
+{
+	uLongf rawlen = col->rawlen;
+	const uint8_t *p, *end;
+	uint8_t *raw = malloc(rawlen + 1);
+	int64_t prev = 0;
+	size_t i;
+
+	if (!raw) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if ((uncompress(raw, &rawlen, packed, col->len) != Z_OK) || (rawlen != col->rawlen)) {
+		free(raw);
+		return -1;
+	}
+
+	p = raw;
+	end = raw + rawlen;
+	for (i = 0; i < count; i++) {
+		uint64_t zz;
+
+		p = varint_decode(p, end, &zz);
+		if (!p) {
+			free(raw);
+			return -1;
+		}
+		prev += zigzag_decode(zz);
+		v[i] = prev;
+	}
+	free(raw);
+	return 0;
+}
+
+static void print_value(int column, int64_t v)
+{
+	switch (column) {
+	case ARCHIVE_TIME:
+		printf("%" PRId64 ".%09" PRId64, v / 1000000000, v % 1000000000);
+		break;
+	case ARCHIVE_LAT:
+	case ARCHIVE_LON:
+		printf("%.7f", v * columns[column].scale);
+		break;
+	case ARCHIVE_ALT:
+	case ARCHIVE_SNR:
+	case ARCHIVE_CNO:
+		printf("%.1f", v * columns[column].scale);
+		break;
+	default:
+		printf("%" PRId64, v);
+	}
+}
+
+static void print_rows(const struct archive_block *block, int64_t **v)
+{
+	size_t sv = 0;
+	uint32_t row;
+	int i;
+
+	for (row = 0; row < block->rows; row++) {
+		size_t nsv = v[ARCHIVE_NSV] ? v[ARCHIVE_NSV][row] : 0;
+		bool match = true;
+
+		for (i = 0; i < nranges; i++) {
+			int c = ranges[i].column;
+			unsigned int flag = archive_column_flag(c);
+
+			/* the epoch had no such value */
+			if (flag && !(v[ARCHIVE_FLAGS][row] & flag))
+				match = false;
+			else if (!in_range(c, v[c][row] * columns[c].scale))
+				match = false;
+		}
+
+		if (match) {
+			for (i = 0; i < nselected; i++) {
+				int c = selected[i];
+				size_t j;
+
+				if (i)
+					putchar(' ');
+				if (c < ARCHIVE_FIRST_SV_COLUMN) {
+					print_value(c, v[c][row]);
+					continue;
+				}
+
+				for (j = 0; j < nsv; j++) {
+					if (j)
+						putchar(',');
+					print_value(c, v[c][sv + j]);
+				}
+				if (!nsv)
+					putchar('-');
+			}
+			putchar('\n');
+		}
+		sv += nsv;
+	}
+}
+
+static int read_block(FILE *f, const struct archive_block *block)
+{
+	int64_t *v[ARCHIVE_COLUMNS] = { NULL };
+	uint8_t *packed = NULL;
+	bool skip = false;
+	uint32_t i;
+	int ret = -1;
+
+	blocks++;
+	for (i = 0; i < block->columns; i++) {
+		struct archive_column col;
+		size_t count;
+
+		if (fread(&col, sizeof(col), 1, f) != 1)
+			goto out;
+
+		if (col.id < ARCHIVE_COLUMNS) {
+			sizes[col.id].values += col.id < ARCHIVE_FIRST_SV_COLUMN ? block->rows : block->svs;
+			sizes[col.id].rawlen += col.rawlen;
+			sizes[col.id].len += col.len;
+		}
+
+		/* nothing in this block can match */
+		if ((col.id < ARCHIVE_COLUMNS) && !overlaps(col.id, col.min, col.max))
+			skip = true;
+
+		if (skip || show_sizes || (col.id >= ARCHIVE_COLUMNS) || !wanted[col.id]) {
+			if (fseek(f, col.len, SEEK_CUR))
+				goto out;
+			continue;
+		}
+
+		count = col.id < ARCHIVE_FIRST_SV_COLUMN ? block->rows : block->svs;
+		packed = realloc(packed, col.len);
+		v[col.id] = malloc((count + 1) * sizeof(int64_t));
+		if (!packed || !v[col.id]) {
+			perror("malloc");
+			exit(1);
+		}
+
+		if ((fread(packed, 1, col.len, f) != col.len) ||
+		    decode_column(&col, packed, v[col.id], count)) {
+			fprintf(stderr, "broken %s column\n", columns[col.id].name);
+			goto out;
+		}
+	}
+
+	if (skip)
+		skipped++;
+	else if (!show_sizes)
+		print_rows(block, v);
+	ret = 0;
+out:
+	free(packed);
+	for (i = 0; i < ARCHIVE_COLUMNS; i++)
+		free(v[i]);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct archive_header header;
+	struct archive_block block;
+	FILE *f;
+	int i;
+
+	if ((argc < 2) || !strcmp(argv[1], "--help")) {
+		fprintf(stderr, "Usage: %s archive [columns=list] [range=column:min:max] [sizes]\n"
+			"columns: fcount time flags lat lon alt nsv sv snr cno\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 2; i < argc; i++) {
+		if (!strncmp(argv[i], "columns=", 8) && parse_columns(argv[i] + 8))
+			return 1;
+
+		if (!strncmp(argv[i], "range=", 6) && parse_range(argv[i] + 6)) {
+			fprintf(stderr, "invalid range %s\n", argv[i] + 6);
+			return 1;
+		}
+
+		if (!strcmp(argv[i], "sizes"))
+			show_sizes = true;
+	}
+
+	if (!nselected)
+		parse_columns("fcount,lat,lon,alt");
+
+	/* per sv values are sliced by nsv */
+	for (i = 0; i < nselected; i++)
+		if (selected[i] >= ARCHIVE_FIRST_SV_COLUMN)
+			wanted[ARCHIVE_NSV] = true;
+
+	f = fopen(argv[1], "r");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if ((fread(&header, sizeof(header), 1, f) != 1) ||
+	    memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) ||
+	    (header.version != ARCHIVE_VERSION)) {
+		fprintf(stderr, "%s: not an archive of version %d\n", argv[1], ARCHIVE_VERSION);
+		return 1;
+	}
+
+	while (fread(&block, sizeof(block), 1, f) == 1) {
+		if (read_block(f, &block)) {
+			fprintf(stderr, "%s: truncated block\n", argv[1]);
+			return 1;
+		}
+	}
+
+	if (show_sizes) {
+		unsigned long long rawlen = 0, len = 0;
+
+		printf("%lu blocks\n", blocks);
+		for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+			printf("%-6s %10llu values %10llu bytes varint %10llu bytes compressed\n",
+			       columns[i].name, sizes[i].values, sizes[i].rawlen, sizes[i].len);
+			rawlen += sizes[i].rawlen;
+			len += sizes[i].len;
+		}
+		printf("total %28llu bytes varint %10llu bytes compressed\n", rawlen, len);
+	} else if (nranges) {
+		fprintf(stderr, "%lu of %lu blocks skipped\n", skipped, blocks);
+	}
+
+	fclose(f);
+	return 0;
+}
@@ -4,6 +4,7 @@
  * should work with TI's /dev/tigps device
  * and also the patched mainline /dev/gnssX interface
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -16,64 +17,108 @@
 #include <sys/select.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <poll.h>
+#include <sched.h>
+#include <malloc.h>
+#include <math.h>
+#include <inttypes.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #ifndef NO_THREADS
 #include <pthread.h>
 #endif
 
-/* we assume machine order = network order = le for simplity here */
-#define AI2_MEASUREMENT 8
-struct __attribute__((__packed__)) measurement_sv {
-	uint32_t fcount; /* probably ms since start of report */
-	struct __attribute__((__packed__)) {
-		uint8_t sv;
-		uint16_t snr;
-		uint16_t cno;
-		uint8_t unknown[23];
-	} svdata[];
-};
+#include <zlib.h>
 
-#define AI2_POSITION 6
-struct __attribute__((__packed__)) position {
-	uint32_t fcount; /* probably ms since start of report */
-	uint16_t unknown1;
-	int32_t lat;
-	int32_t lon;
-	int16_t altitude;
-	uint8_t unknown2[15];
-	struct __attribute__((__packed__)) {
-		uint8_t sv;
-		uint8_t unknown[5];
-	} svdata[];
-};
+#include "ai2.h"
+#include "archive.h"
+#include "gps-record.h"
 
-#define AI2_NMEA 0xd3
-struct __attribute__((__packed__)) nmea {
-	uint32_t fcount;
-	char nmea[];
-};
+static bool nmeaout;
+static bool noinit;
+static bool noprocess;
+static bool showstats;
+static bool binout_stdout;
+static bool jsonout;
 
-#define AI2_POSITION_EXT 0xd5
-struct __attribute__((__packed__)) position_ext {
-	uint32_t fcount; /* probably ms since start of report */
-	uint16_t unknown1;
-	int32_t lat;
-	int32_t lon;
-	uint8_t unknown[47];
-	struct __attribute__((__packed__)) {
-		uint8_t sv;
-		uint8_t unknown[5];
-	} svdata[];
-};
+/* maximum wakeups per second of the reader, 0 for unlimited */
+static unsigned int wakeup_budget;
+#define MAX_WAKEUPS 100000
+
+/*
+ * Diagnostics have a level and a category and are only formatted,
+ * arguments included, when both are enabled. Levels above
+ * LOG_MAX_LEVEL are compiled out, e.g. make CPPFLAGS=-DLOG_MAX_LEVEL=2
+ */
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_VERBOSE 2
+#define LOG_DEBUG 3
 
-#define AI2_ASYNC_EVENT 0x80
-#define AI2_ASYNC_EVENT_ENG_IDLE 0x07
-#define AI2_ASYNC_EVENT_ENG_OFF 0x01
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
 
-#define AI2_ERROR 0xf5
+#define LOG_EVENTS (1 << 0)	/* async events and error reports */
+#define LOG_ACKS (1 << 1)
+#define LOG_SV (1 << 2)		/* per satellite lines */
+#define LOG_PACKETS (1 << 3)	/* packet type and length, unknown packets */
+#define LOG_FRAMING (1 << 4)	/* broken frames, discarded bytes */
+#define LOG_ALL 0x1f
 
-static bool nmeaout;
-static bool noinit;
-static bool noprocess;
+static int log_level = LOG_VERBOSE;
+static unsigned int log_categories = LOG_ALL;
+
+#define LOG_ON(level, category) (((level) <= LOG_MAX_LEVEL) && \
+				 ((level) <= log_level) && (log_categories & (category)))
+
+#define LOG(level, category, ...) do {				\
+		if (LOG_ON(level, category))			\
+			decode_info_out(__VA_ARGS__);		\
+	} while (0)
+
+/* comma separated category names */
+static int parse_log_categories(const char *list)
+{
+	static const char *names[] = { "events", "acks", "sv", "packets", "framing" };
+	const int count = sizeof(names) / sizeof(names[0]);
+
+	log_categories = 0;
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		int i;
+
+		for (i = 0; i < count; i++)
+			if ((strlen(names[i]) == len) && !strncmp(names[i], list, len))
+				break;
+
+		if (i == count)
+			return -1;
+
+		log_categories |= 1 << i;
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return 0;
+}
+
+/* stdout is taken by NMEA sentences or binary records */
+static FILE *info_file(void)
+{
+	return (nmeaout || binout_stdout) ? stderr : stdout;
+}
 
 __attribute__((__format__ (__printf__, 1, 2)))
 static void decode_info_out(const char *format, ...)
@@ -81,31 +126,447 @@ static void decode_info_out(const char *format, ...)
 	va_list ap;
 
 	va_start(ap, format);
-	vfprintf(nmeaout ? stderr: stdout, format, ap);
+	vfprintf(info_file(), format, ap);
 	va_end(ap);
 }
 
+static void decode_info_write(const char *buf, size_t len)
+{
+	fwrite(buf, 1, len, info_file());
+}
+
+/* only records go into the JSON stream, complaints go here instead */
+static FILE *json_errors;
+
+static FILE *err_file(void)
+{
+	return jsonout ? json_errors : info_file();
+}
+
 __attribute__((__format__ (__printf__, 1, 2)))
 static void decode_err_out(const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	vfprintf(nmeaout ? stderr : stdout, format, ap);
+	vfprintf(err_file(), format, ap);
 	va_end(ap);
 }
 
-static void process_nmea(const uint8_t *data, int len)
+/* n times c, without going through printf for every single one */
+static void decode_err_fill(char c, size_t n)
+{
+	char buf[256];
+
+	memset(buf, c, n < sizeof(buf) ? n : sizeof(buf));
+	while (n) {
+		size_t len = n < sizeof(buf) ? n : sizeof(buf);
+
+		fwrite(buf, 1, len, err_file());
+		n -= len;
+	}
+}
+
+/*
+ * Complaints about broken input are limited to a burst per second,
+ * so a misbehaving receiver cannot keep the reader busy printing.
+ */
+#define ERR_BURST 20
+
+static struct {
+	uint64_t window;
+	unsigned int count;
+	unsigned long suppressed;
+} err_limit;
+
+static bool decode_err_allowed(uint64_t now)
+{
+	if (now - err_limit.window >= 1000000000ull) {
+		if (err_limit.suppressed)
+			decode_err_out("%lu messages suppressed\n", err_limit.suppressed);
+
+		err_limit.window = now;
+		err_limit.count = 0;
+		err_limit.suppressed = 0;
+	}
+
+	if (err_limit.count >= ERR_BURST) {
+		err_limit.suppressed++;
+		return false;
+	}
+
+	err_limit.count++;
+	return true;
+}
+
+static uint64_t ts_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_to_ns(&ts);
+}
+
+/* to turn CLOCK_MONOTONIC times into CLOCK_REALTIME */
+static int64_t realtime_offset(void)
+{
+	struct timespec mono, real;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	return ts_to_ns(&real) - ts_to_ns(&mono);
+}
+
+/* cpu cycle counter where userspace can read one, else 0 */
+static uint64_t cycles_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Optional tracing of where the time goes, written as Chrome trace
+ * event JSON (chrome://tracing, ui.perfetto.dev). Every thread
+ * records spans into its own ring buffer, so recording needs no locks,
+ * and the most recent TRACE_EVENTS per thread are kept. With tracing
+ * off, a span costs a check of a global flag.
+ */
+#define TRACE_EVENTS 65536
+
+struct trace_event {
+	const char *name;
+	uint64_t start;
+	uint64_t dur;
+	uint32_t bytes;
+};
+
+struct trace_buf {
+	struct trace_buf *next;
+	pid_t tid;
+	const char *thread;
+	uint64_t head;
+	struct trace_event ev[TRACE_EVENTS];
+};
+
+static bool tracing;
+static const char *trace_path;
+static struct trace_buf *trace_bufs;
+static __thread struct trace_buf *trace_own;
+static __thread const char *trace_thread = "main";
+
+static uint64_t trace_start(void)
+{
+	return tracing ? now_ns() : 0;
+}
+
+static void trace_record(const char *name, uint64_t start, uint32_t bytes)
+{
+	struct trace_buf *t = trace_own;
+	struct trace_event *e;
+	uint64_t end = now_ns();
+
+	if (!t) {
+		t = calloc(1, sizeof(*t));
+		if (!t)
+			return;
+
+		t->tid = syscall(SYS_gettid);
+		t->thread = trace_thread;
+		t->next = __atomic_load_n(&trace_bufs, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&trace_bufs, &t->next, t, true,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		trace_own = t;
+	}
+
+	e = &t->ev[t->head % TRACE_EVENTS];
+	e->name = name;
+	e->start = start;
+	e->dur = end - start;
+	e->bytes = bytes;
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_end(const char *name, uint64_t start, uint32_t bytes)
+{
+	if (tracing)
+		trace_record(name, start, bytes);
+}
+
+/*
+ * Writes what is in the buffers while the threads may go on recording,
+ * events overwritten during the copy are left out.
+ */
+static void trace_write(void)
+{
+	struct trace_event *copy = malloc(sizeof(copy[0]) * TRACE_EVENTS);
+	struct trace_buf *t;
+	bool first = true;
+	pid_t pid = getpid();
+	FILE *f;
+
+	if (!copy)
+		return;
+
+	f = fopen(trace_path, "w");
+	if (!f) {
+		perror(trace_path);
+		free(copy);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	for (t = __atomic_load_n(&trace_bufs, __ATOMIC_ACQUIRE); t; t = t->next) {
+		uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		uint64_t from = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+		uint64_t i, now;
+
+		for (i = from; i < head; i++)
+			copy[i % TRACE_EVENTS] = t->ev[i % TRACE_EVENTS];
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		now = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+		if (now > TRACE_EVENTS && now - TRACE_EVENTS > from)
+			from = now - TRACE_EVENTS;
+
+		fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+			first ? "" : ",", (int)pid, (int)t->tid, t->thread);
+		first = false;
+		for (i = from; i < head; i++) {
+			const struct trace_event *e = &copy[i % TRACE_EVENTS];
+
+			fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %" PRIu64 ".%03u, \"dur\": %" PRIu64 ".%03u, \"pid\": %d, \"tid\": %d, \"args\": {\"bytes\": %u}}",
+				e->name, e->start / 1000, (unsigned int)(e->start % 1000),
+				e->dur / 1000, (unsigned int)(e->dur % 1000), (int)pid, (int)t->tid, e->bytes);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	free(copy);
+}
+
+static void trace_setup(void)
+{
+	tracing = true;
+	atexit(trace_write);
+}
+
+/*
+ * Frames live in reference counted buffers from a pool of power of two
+ * sized slabs. Once the pool has warmed up, no more allocations
+ * are done. Anyone wanting to keep a frame beyond its handler call
+ * takes a reference instead of copying it.
+ */
+struct ai2_frame {
+	struct ai2_frame *next;
+	int refcount;
+	unsigned int order;
+	size_t size;
+	size_t len;
+	/* CLOCK_MONOTONIC when the read completing the frame returned */
+	uint64_t rx_ns;
+	uint8_t data[];
+};
+
+#define FRAME_MIN_ORDER 8
+#define FRAME_ORDERS 24
+/* the largest frame_get() hands out */
+#define FRAME_MAX_SIZE ((size_t)1 << (FRAME_MIN_ORDER + FRAME_ORDERS - 1))
+
+static struct {
+#ifndef NO_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct ai2_frame *free[FRAME_ORDERS];
+	unsigned long allocs;
+	unsigned long in_use;
+} frame_pool = {
+#ifndef NO_THREADS
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static size_t max_frame = 65536;
+/* mlockall() and allocate everything up front */
+static bool lock_memory;
+
+static void frame_pool_lock(void)
+{
+#ifndef NO_THREADS
+	pthread_mutex_lock(&frame_pool.lock);
+#endif
+}
+
+static void frame_pool_unlock(void)
+{
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&frame_pool.lock);
+#endif
+}
+
+static struct ai2_frame *frame_get(size_t size)
+{
+	struct ai2_frame *f;
+	unsigned int order = FRAME_MIN_ORDER;
+
+	while (((size_t)1 << order) < size)
+		order++;
+
+	if (order - FRAME_MIN_ORDER >= FRAME_ORDERS)
+		return NULL;
+
+	frame_pool_lock();
+	f = frame_pool.free[order - FRAME_MIN_ORDER];
+	if (f)
+		frame_pool.free[order - FRAME_MIN_ORDER] = f->next;
+	else
+		frame_pool.allocs++;
+
+	frame_pool.in_use++;
+	frame_pool_unlock();
+
+	if (!f) {
+		f = malloc(sizeof(*f) + ((size_t)1 << order));
+		if (!f) {
+			perror("malloc");
+			exit(1);
+		}
+		f->order = order;
+		f->size = (size_t)1 << order;
+	}
+
+	f->next = NULL;
+	f->refcount = 1;
+	f->len = 0;
+	return f;
+}
+
+static void frame_ref(struct ai2_frame *f)
+{
+	__atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void frame_put(struct ai2_frame *f)
+{
+	if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	frame_pool_lock();
+	f->next = frame_pool.free[f->order - FRAME_MIN_ORDER];
+	frame_pool.free[f->order - FRAME_MIN_ORDER] = f;
+	frame_pool.in_use--;
+	frame_pool_unlock();
+}
+
+static bool frame_shared(struct ai2_frame *f)
+{
+	return __atomic_load_n(&f->refcount, __ATOMIC_ACQUIRE) != 1;
+}
+
+/* replaces f with a bigger frame, keeping its contents */
+static struct ai2_frame *frame_grow(struct ai2_frame *f, size_t size)
+{
+	struct ai2_frame *n = frame_get(size);
+
+	if (!n)
+		return NULL;
+
+	memcpy(n->data, f->data, f->len);
+	n->len = f->len;
+	frame_put(f);
+	return n;
+}
+
+struct ai2_packet {
+	uint8_t class;
+	uint8_t type;
+	const uint8_t *data;
+	int len;
+	/* the frame data points into, frame_ref() it to keep it */
+	struct ai2_frame *frame;
+	uint64_t rx_ns;
+};
+
+typedef void (*packet_handler)(const struct ai2_packet *pkt);
+
+/*
+ * handlers are looked up by (class, type), classes above AI2_CLASSES
+ * only ever reach the default handler.
+ */
+#define AI2_CLASSES 4
+#define AI2_ANY_CLASS -1
+#define MAX_HANDLERS 8
+
+struct handler_list {
+	int count;
+	packet_handler fn[MAX_HANDLERS];
+};
+
+static struct handler_list dispatch[AI2_CLASSES][256];
+/* called for everything nobody subscribed to, may be NULL */
+static packet_handler default_handler;
+static bool positions_only;
+static bool hexunknown;
+/* do not even checksum frames with only unsubscribed packets */
+static bool lazy;
+
+static int register_handler(int class, uint8_t type, packet_handler fn)
+{
+	struct handler_list *h;
+	int i;
+
+	if (class == AI2_ANY_CLASS) {
+		for (i = 0; i < AI2_CLASSES; i++)
+			if (register_handler(i, type, fn))
+				return -1;
+
+		return 0;
+	}
+
+	if ((class < 0) || (class >= AI2_CLASSES))
+		return -1;
+
+	h = &dispatch[class][type];
+	if (h->count == MAX_HANDLERS)
+		return -1;
+
+	h->fn[h->count] = fn;
+	h->count++;
+	return 0;
+}
+
+static bool is_subscribed(uint8_t class, uint8_t type)
+{
+	if (class >= AI2_CLASSES)
+		return false;
+
+	return dispatch[class][type].count > 0;
+}
+
+static void process_nmea(const struct ai2_packet *pkt)
 {
-	const struct nmea *p = (const struct nmea *) data;
+	const struct nmea *p = (const struct nmea *) pkt->data;
+	int len = pkt->len;
+	if (len < 4)
+		return;
+
 	decode_info_out("nmea: fcount: %d:", p->fcount);
 	if (len > 4) {
-		fwrite(p->nmea, 1, len - 4, stdout);
+		fwrite(p->nmea, 1, len - 4, binout_stdout ? stderr : stdout);
 	}
 }
 
-static void process_position_ext(const uint8_t *data, int len)
+static void process_position_ext(const struct ai2_packet *pkt)
 {
-	const struct position_ext *p = (const struct position_ext *) data;
+	const struct position_ext *p = (const struct position_ext *) pkt->data;
+	int len = pkt->len;
 	int i;
 	if (len < sizeof(struct position_ext))
 	       return;
@@ -122,9 +583,10 @@ static void process_position_ext(const uint8_t *data, int len)
 	decode_info_out("\n");
 }
 
-static void process_position(const uint8_t *data, int len)
+static void process_position(const struct ai2_packet *pkt)
 {
-	const struct position *p = (const struct position *) data;
+	const struct position *p = (const struct position *) pkt->data;
+	int len = pkt->len;
 	int i;
 	if (len < sizeof(struct position))
 	       return;
@@ -142,390 +604,3838 @@ static void process_position(const uint8_t *data, int len)
 	decode_info_out("\n");
 }
 
-static void process_measurement(const uint8_t *data, int len)
+static void process_measurement(const struct ai2_packet *pkt)
 {
 	int sats;
 	int i;
-	const struct measurement_sv *sv = (const struct measurement_sv *)data;
+	const struct measurement_sv *sv = (const struct measurement_sv *)pkt->data;
+	int len = pkt->len;
         if (len < 4)
 	  return;
 
         sats = (len - 4) / sizeof(sv->svdata[0]);
 	decode_info_out("measurement: fcount: %d, sats: %d\n", sv->fcount, sats);
 	if ((len - 4) % sizeof(sv->svdata[0])) {
-	    printf("measurement: excess data\n");
+	    decode_info_out("measurement: excess data\n");
 	}
 
+	if (!LOG_ON(LOG_INFO, LOG_SV))
+		return;
+
 	for(i = 0; i < sats; i++) {
 		decode_info_out("SV: %d SNR: %.1f CNo: %.1f\n", sv->svdata[i].sv, (double)sv->svdata[i].snr / 10, (double)sv->svdata[i].cno / 10);
 	}
 }
 
-static void process_async_event(const uint8_t *data, int len)
+static void process_async_event(const struct ai2_packet *pkt)
 {
-	switch(data[0]) {
+	if (pkt->len < 1)
+		return;
+
+	switch(pkt->data[0]) {
 		case AI2_ASYNC_EVENT_ENG_IDLE:
-			decode_info_out("Event: machine idle\n");
+			LOG(LOG_INFO, LOG_EVENTS, "Event: machine idle\n");
 			break;
 		case AI2_ASYNC_EVENT_ENG_OFF:
-			decode_info_out("Event: machine off\n");
+			LOG(LOG_INFO, LOG_EVENTS, "Event: machine off\n");
 			break;
 		default:
-			decode_info_out("Event: unknown (%02x)\n", data[0]);
+			LOG(LOG_INFO, LOG_EVENTS, "Event: unknown (%02x)\n", pkt->data[0]);
 
 	}
 }
 
-static void dump_packet(uint8_t class, uint8_t type, const uint8_t *data, int len)
+static void process_error(const struct ai2_packet *pkt)
 {
-	int i;
-	decode_info_out("0x%02x, 0x%02x, {", class, type);
-	for(i = 0; i < len; i++)
-		decode_info_out("0x%02x, ", data[i]);
+	const uint8_t *data = pkt->data;
+	if (pkt->len == 2) {
+		uint16_t err = data[1];
+		err <<= 8;
+		err |= data[0];
+		switch(err) {
+			case 0x02ff:
+				LOG(LOG_ERROR, LOG_EVENTS, "error invalid checksum\n ");
+				break;
+			default:
+				LOG(LOG_ERROR, LOG_EVENTS, "got error code %04x\n ", err);
+		}
+	} else
+		LOG(LOG_ERROR, LOG_EVENTS, "got error with len %d\n", pkt->len);
+}
 
-	decode_info_out("}\n");
+static void print_packet_info(const struct ai2_packet *pkt)
+{
+	decode_info_out("packet type %x, payload: %d\n", pkt->type, pkt->len);
+}
 
-	decode_info_out("%02x, %02x, ", class, type);
-	for(i = 0; i < len; i++)
-		decode_info_out("%02x", data[i]);
+static void print_unknown(const struct ai2_packet *pkt)
+{
+	decode_info_out("unknown packet type %x len: %d\n", (int)pkt->type, pkt->len);
+}
 
-	decode_info_out("\n");
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+		   h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+
+static const char hexpairs[] =
+	HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3")
+	HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+	HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b")
+	HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+static char *hex_byte(char *dest, uint8_t c)
+{
+	memcpy(dest, hexpairs + 2 * c, 2);
+	return dest + 2;
 }
 
-static void process_packet(uint8_t class, uint8_t type, const uint8_t *data, int len)
+static char *hex_encode(char *dest, const uint8_t *src, size_t len)
 {
-	int i;
-	if (noprocess) {
-		dump_packet(class, type, data, len);
-		return;
-	}
+	size_t i;
 
-	decode_info_out("packet type %x, payload: %d\n", type, len);
-	switch(type) {
-	case AI2_MEASUREMENT:
-		process_measurement(data, len);
-		break;
-	case AI2_POSITION:
-		process_position(data, len);
-		break;
-	case AI2_NMEA:
-		process_nmea(data, len);
-		break;
-	case AI2_POSITION_EXT:
-		process_position_ext(data, len);
-		break;
-	case AI2_ASYNC_EVENT:
-		process_async_event(data, len);
-		break;
-	case AI2_ERROR:
-		if (len == 2) {
-			uint16_t err = data[1];
-			err <<= 8;
-			err |= data[0];
-			switch(err) {
-				case 0x02ff:
-					decode_info_out("error invalid checksum\n ", err);
-					break;
-				default:
-					decode_info_out("got error code %04x\n ", err);
-			}
-		} else
-			decode_info_out("got error with len %d\n", len);
-		break;
-	default:
-		decode_info_out("unknown packet type %x len: %d ", (int)type, len);
-		for(i = 0; i < len; i++) {
-			decode_info_out("%02x", data[i]);
+	for (i = 0; i < len; i++)
+		dest = hex_byte(dest, src[i]);
+
+	return dest;
+}
+
+/* reused for formatting whole packets at once */
+static struct {
+	char *buf;
+	size_t size;
+} outbuf;
+
+static char *outbuf_get(size_t size)
+{
+	if (outbuf.size < size) {
+		outbuf.buf = realloc(outbuf.buf, size);
+		if (!outbuf.buf) {
+			perror("realloc");
+			exit(1);
 		}
-		decode_info_out("\n");
+		outbuf.size = size;
 	}
+	return outbuf.buf;
 }
 
-static int append_packet(uint8_t *pkt, int pktpos, uint8_t data)
+static void print_unknown_hex(const struct ai2_packet *pkt)
 {
-	pkt[pktpos] = data;
-	pktpos++;
-	if (data == 0x10) {
-		pkt[pktpos] = data;
-		pktpos++;
-	}
-	return pktpos;
+	char *buf = outbuf_get(64 + 2 * pkt->len);
+	char *p = buf;
+
+	p += sprintf(p, "unknown packet type %x len: %d ", (int)pkt->type, pkt->len);
+	p = hex_encode(p, pkt->data, pkt->len);
+	*p = '\n';
+	p++;
+	decode_info_write(buf, p - buf);
 }
 
-static int write_packet(int fd, uint8_t class, uint8_t cmd, uint8_t *data, uint16_t len)
+/*
+ * Both the C array and the plain hex form are rendered in one go,
+ * the plain one starts right after where the array one will end.
+ */
+static void dump_packet(const struct ai2_packet *pkt)
 {
-	uint8_t *pkt = calloc(1, 4 + len * 2  + 2);
+	static const char head[] = "0x.., 0x.., {";
+	char *buf = outbuf_get(sizeof(head) + 6 * pkt->len + 16 + 2 * pkt->len);
+	char *a = buf;
+	char *b;
 	int i;
-	int ret;
-	uint16_t sum;
-	int pktpos = 2;
-	pkt[0] = 0x10;
-	pkt[1] = class;
 
-	sum = 0x10 + class + cmd;
-	sum += len & 0xff;
+	memcpy(a, head, sizeof(head) - 1);
+	hex_byte(a + 2, pkt->class);
+	hex_byte(a + 8, pkt->type);
+	a += sizeof(head) - 1;
+
+	b = a + 6 * pkt->len;
+	memcpy(b, "}\n", 2);
+	b = hex_byte(b + 2, pkt->class);
+	memcpy(b, ", ", 2);
+	b = hex_byte(b + 2, pkt->type);
+	memcpy(b, ", ", 2);
+	b += 2;
+
+	for(i = 0; i < pkt->len; i++) {
+		const char *hex = hexpairs + 2 * pkt->data[i];
+
+		a[0] = '0';
+		a[1] = 'x';
+		a[2] = hex[0];
+		a[3] = hex[1];
+		a[4] = ',';
+		a[5] = ' ';
+		a += 6;
+		b[0] = hex[0];
+		b[1] = hex[1];
+		b += 2;
+	}
+	*b = '\n';
+	b++;
+	decode_info_write(buf, b - buf);
+}
+
+/*
+ * JSON lines, one object per report. Each one is put together in
+ * outbuf, sized for the worst case up front, with numbers formatted
+ * by hand: integers digit by digit and decimals as scaled integers.
+ */
+#define JSON_LIT(p, s) (memcpy(p, s, sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+static char *json_uint(char *p, uint64_t v)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static const uint32_t powers10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+/* v / 10^decimals, up to 9 */
+static char *json_fixed(char *p, int64_t v, int decimals)
+{
+	uint64_t a = v < 0 ? -(uint64_t)v : v;
+	int i;
+
+	if (v < 0)
+		*p++ = '-';
+	p = json_uint(p, a / powers10[decimals]);
+	if (!decimals)
+		return p;
+	*p++ = '.';
+	a %= powers10[decimals];
+	for (i = decimals - 1; i >= 0; i--) {
+		p[i] = '0' + a % 10;
+		a /= 10;
+	}
+	return p + decimals;
+}
+
+/* raw latitude or longitude with up to 7 decimals, rounded */
+static char *json_degrees(char *p, int32_t raw, int range, int decimals)
+{
+	return json_fixed(p, ((int64_t)raw * range * powers10[decimals] + (1 << 30)) >> 31, decimals);
+}
+
+static char *json_head(char *p, const char *type, size_t len, const struct ai2_packet *pkt)
+{
+	p = JSON_LIT(p, "{\"type\":\"");
+	memcpy(p, type, len);
+	p += len;
+	p = JSON_LIT(p, "\",\"class\":");
+	return json_uint(p, pkt->class);
+}
+
+static void json_end(char *buf, char *p)
+{
+	p = JSON_LIT(p, "}\n");
+	decode_info_write(buf, p - buf);
+}
+
+static void json_position(const struct ai2_packet *pkt)
+{
+	const struct position *p = (const struct position *)pkt->data;
+	const struct position_ext *e = (const struct position_ext *)pkt->data;
+	bool ext = pkt->type == AI2_POSITION_EXT;
+	size_t head = ext ? offsetof(struct position_ext, svdata) : offsetof(struct position, svdata);
+	int sats, i;
+	char *buf, *o;
+
+	if (pkt->len < (ext ? sizeof(*e) : sizeof(*p)))
+		return;
+
+	sats = (pkt->len - head) / sizeof(p->svdata[0]);
+	buf = outbuf_get(160 + 4 * sats);
+	if (ext)
+		o = json_head(buf, "position_ext", 12, pkt);
+	else
+		o = json_head(buf, "position", 8, pkt);
+
+	o = JSON_LIT(o, ",\"fcount\":");
+	o = json_uint(o, p->fcount);
+	o = JSON_LIT(o, ",\"lat\":");
+	o = json_degrees(o, ext ? e->lat : p->lat, 90, 7);
+	o = JSON_LIT(o, ",\"lon\":");
+	o = json_degrees(o, ext ? e->lon : p->lon, 180, 7);
+	if (!ext) {
+		o = JSON_LIT(o, ",\"alt\":");
+		o = json_fixed(o, p->altitude * 5, 1);
+	}
+	o = JSON_LIT(o, ",\"sv\":[");
+	for (i = 0; i < sats; i++) {
+		const uint8_t *sv = pkt->data + head + i * sizeof(p->svdata[0]);
+
+		if (i)
+			*o++ = ',';
+		o = json_uint(o, *sv);
+	}
+	*o++ = ']';
+	json_end(buf, o);
+}
+
+static void json_measurement(const struct ai2_packet *pkt)
+{
+	const struct measurement_sv *m = (const struct measurement_sv *)pkt->data;
+	int sats, i;
+	char *buf, *o;
+
+	if (pkt->len < 4)
+		return;
+
+	sats = (pkt->len - 4) / sizeof(m->svdata[0]);
+	buf = outbuf_get(96 + 48 * sats);
+	o = json_head(buf, "measurement", 11, pkt);
+	o = JSON_LIT(o, ",\"fcount\":");
+	o = json_uint(o, m->fcount);
+	o = JSON_LIT(o, ",\"svs\":[");
+	for (i = 0; i < sats; i++) {
+		if (i)
+			*o++ = ',';
+		o = JSON_LIT(o, "{\"sv\":");
+		o = json_uint(o, m->svdata[i].sv);
+		o = JSON_LIT(o, ",\"snr\":");
+		o = json_fixed(o, m->svdata[i].snr, 1);
+		o = JSON_LIT(o, ",\"cno\":");
+		o = json_fixed(o, m->svdata[i].cno, 1);
+		*o++ = '}';
+	}
+	*o++ = ']';
+	json_end(buf, o);
+}
+
+static void json_event(const struct ai2_packet *pkt)
+{
+	char *buf = outbuf_get(96);
+	char *o;
+
+	if (pkt->len < 1)
+		return;
+
+	o = json_head(buf, "event", 5, pkt);
+	switch (pkt->data[0]) {
+	case AI2_ASYNC_EVENT_ENG_IDLE:
+		o = JSON_LIT(o, ",\"event\":\"idle\"");
+		break;
+	case AI2_ASYNC_EVENT_ENG_OFF:
+		o = JSON_LIT(o, ",\"event\":\"off\"");
+		break;
+	default:
+		o = JSON_LIT(o, ",\"event\":\"unknown\"");
+	}
+	o = JSON_LIT(o, ",\"code\":");
+	o = json_uint(o, pkt->data[0]);
+	json_end(buf, o);
+}
+
+static void json_error(const struct ai2_packet *pkt)
+{
+	char *buf = outbuf_get(96);
+	char *o = json_head(buf, "error", 5, pkt);
+
+	if (pkt->len == 2) {
+		o = JSON_LIT(o, ",\"code\":");
+		o = json_uint(o, pkt->data[0] | (pkt->data[1] << 8));
+	} else {
+		o = JSON_LIT(o, ",\"len\":");
+		o = json_uint(o, pkt->len);
+	}
+	json_end(buf, o);
+}
+
+static void json_ack(void)
+{
+	static const char ack[] = "{\"type\":\"ack\"}\n";
+
+	decode_info_write(ack, sizeof(ack) - 1);
+}
+
+/*
+ * template= output, a line per position report. The template is
+ * compiled once into ops, so each report only gets the fields it
+ * refers to computed and formatted.
+ */
+enum {
+	TMPL_TEXT,
+	TMPL_FCOUNT,
+	TMPL_LAT,
+	TMPL_LON,
+	TMPL_ALT,
+	TMPL_NSV,
+	TMPL_SV,
+	TMPL_CLASS,
+	TMPL_TIME,
+	TMPL_FIELDS,
+};
+
+static const struct {
+	const char *name;
+	int decimals;
+	int max_decimals;
+} tmpl_fields[TMPL_FIELDS] = {
+	[TMPL_FCOUNT] = { "fcount", 0, 0 },
+	[TMPL_LAT] = { "lat", 6, 7 },
+	[TMPL_LON] = { "lon", 6, 7 },
+	[TMPL_ALT] = { "alt", 1, 1 },
+	[TMPL_NSV] = { "nsv", 0, 0 },
+	[TMPL_SV] = { "sv", 0, 0 },
+	[TMPL_CLASS] = { "class", 0, 0 },
+	[TMPL_TIME] = { "time", 6, 9 },
+};
+
+#define TMPL_MAX_OPS 64
+
+static const char *template;
+static struct {
+	uint8_t field;
+	uint8_t decimals;
+	uint16_t len;
+	const char *text;
+} tmpl_ops[TMPL_MAX_OPS];
+static int tmpl_nops;
+static size_t tmpl_textlen;
+static int64_t tmpl_realtime;
+
+static int tmpl_add(int field, int decimals, const char *text, size_t len)
+{
+	if (tmpl_nops == TMPL_MAX_OPS) {
+		fprintf(stderr, "template too long\n");
+		return -1;
+	}
+
+	tmpl_ops[tmpl_nops].field = field;
+	tmpl_ops[tmpl_nops].decimals = decimals;
+	tmpl_ops[tmpl_nops].text = text;
+	tmpl_ops[tmpl_nops].len = len;
+	tmpl_nops++;
+	tmpl_textlen += len;
+	return 0;
+}
+
+/* "text {field} {field:.decimals} {{" */
+static int template_compile(const char *t)
+{
+	while (*t) {
+		size_t len = strcspn(t, "{");
+		const char *end;
+		int field, decimals;
+		size_t namelen;
+
+		if (len && tmpl_add(TMPL_TEXT, 0, t, len))
+			return -1;
+
+		t += len;
+		if (!*t)
+			break;
+
+		if (t[1] == '{') {
+			if (tmpl_add(TMPL_TEXT, 0, t, 1))
+				return -1;
+			t += 2;
+			continue;
+		}
+
+		end = strchr(t, '}');
+		if (!end) {
+			fprintf(stderr, "template: missing }\n");
+			return -1;
+		}
+
+		t++;
+		namelen = strcspn(t, ":}");
+		for (field = TMPL_TEXT + 1; field < TMPL_FIELDS; field++)
+			if ((strlen(tmpl_fields[field].name) == namelen) &&
+			    !strncmp(tmpl_fields[field].name, t, namelen))
+				break;
+
+		if (field == TMPL_FIELDS) {
+			fprintf(stderr, "template: unknown field %.*s\n", (int)namelen, t);
+			return -1;
+		}
+
+		decimals = tmpl_fields[field].decimals;
+		if (t[namelen] == ':') {
+			const char *d = t + namelen + 1;
+			char *dend = NULL;
+			long v = -1;
+
+			/* nothing but the digits up to the } */
+			if ((d[0] == '.') && isdigit((unsigned char)d[1]))
+				v = strtol(d + 1, &dend, 10);
+			if ((dend != end) || (v < 0) || (v > tmpl_fields[field].max_decimals)) {
+				fprintf(stderr, "template: %s takes :.0 to :.%d\n",
+					tmpl_fields[field].name, tmpl_fields[field].max_decimals);
+				return -1;
+			}
+			decimals = v;
+		}
+
+		if (tmpl_add(field, decimals, NULL, 0))
+			return -1;
+		t = end + 1;
+	}
+
+	tmpl_realtime = realtime_offset();
+	return tmpl_add(TMPL_TEXT, 0, "\n", 1);
+}
+
+/* position_ext has no altitude, it is printed as - */
+static void template_position(const struct ai2_packet *pkt)
+{
+	const struct position *p = (const struct position *)pkt->data;
+	const struct position_ext *e = (const struct position_ext *)pkt->data;
+	bool ext = pkt->type == AI2_POSITION_EXT;
+	size_t head = ext ? offsetof(struct position_ext, svdata) : offsetof(struct position, svdata);
+	int sats, i, j;
+	int64_t alt;
+	char *buf, *o;
+
+	if (pkt->len < (ext ? sizeof(*e) : sizeof(*p)))
+		return;
+
+	sats = (pkt->len - head) / sizeof(p->svdata[0]);
+	buf = outbuf_get(tmpl_textlen + 32 * tmpl_nops + 4 * sats);
+	o = buf;
+	for (i = 0; i < tmpl_nops; i++) {
+		int decimals = tmpl_ops[i].decimals;
+
+		switch (tmpl_ops[i].field) {
+		case TMPL_TEXT:
+			memcpy(o, tmpl_ops[i].text, tmpl_ops[i].len);
+			o += tmpl_ops[i].len;
+			break;
+		case TMPL_FCOUNT:
+			o = json_uint(o, p->fcount);
+			break;
+		case TMPL_LAT:
+			o = json_degrees(o, ext ? e->lat : p->lat, 90, decimals);
+			break;
+		case TMPL_LON:
+			o = json_degrees(o, ext ? e->lon : p->lon, 180, decimals);
+			break;
+		case TMPL_ALT:
+			if (ext) {
+				*o++ = '-';
+				break;
+			}
+			/* half meters, a half unit rounds away from zero */
+			alt = p->altitude * (int64_t)powers10[decimals];
+			o = json_fixed(o, (alt + (alt < 0 ? -1 : 1)) / 2, decimals);
+			break;
+		case TMPL_NSV:
+			o = json_uint(o, sats);
+			break;
+		case TMPL_SV:
+			for (j = 0; j < sats; j++) {
+				if (j)
+					*o++ = ',';
+				o = json_uint(o, pkt->data[head + j * sizeof(p->svdata[0])]);
+			}
+			break;
+		case TMPL_CLASS:
+			o = json_uint(o, pkt->class);
+			break;
+		case TMPL_TIME:
+			o = json_fixed(o, (pkt->rx_ns + tmpl_realtime) / powers10[9 - decimals], decimals);
+			break;
+		}
+	}
+	decode_info_write(buf, o - buf);
+}
+
+/*
+ * fcount is the receiver's millisecond counter. Fitting it against the
+ * arrival time of the first report of each epoch gives the host time
+ * of any fcount, along with the drift of the receiver clock and the
+ * jitter around the fit.
+ */
+#define FCLOCK_WINDOW 64
+
+static struct {
+	unsigned long samples;
+	uint32_t last;
+	/* last fcount without wraparounds */
+	int64_t fcount;
+	int n;
+	int head;
+	int64_t x[FCLOCK_WINDOW];
+	uint64_t y[FCLOCK_WINDOW];
+	/* host ns = base_ns + (fcount - base_fcount) * slope */
+	int64_t base_fcount;
+	uint64_t base_ns;
+	double slope;
+	double jitter_ns;
+} fclock;
+
+static void fclock_fit(void)
+{
+	int newest = (fclock.head + FCLOCK_WINDOW - 1) % FCLOCK_WINDOW;
+	int64_t x0 = fclock.x[newest];
+	uint64_t y0 = fclock.y[newest];
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double intercept, res = 0;
+	int i;
+
+	fclock.base_fcount = x0;
+	fclock.base_ns = y0;
+	fclock.slope = 1e6;
+	fclock.jitter_ns = 0;
+	if (fclock.n < 2)
+		return;
+
+	for (i = 0; i < fclock.n; i++) {
+		double dx = fclock.x[i] - x0;
+		double dy = (int64_t)(fclock.y[i] - y0);
+
+		sx += dx;
+		sy += dy;
+		sxx += dx * dx;
+		sxy += dx * dy;
+	}
+
+	fclock.slope = (fclock.n * sxy - sx * sy) / (fclock.n * sxx - sx * sx);
+	intercept = (sy - fclock.slope * sx) / fclock.n;
+	fclock.base_ns = y0 + (int64_t)intercept;
+	for (i = 0; i < fclock.n; i++) {
+		double dx = fclock.x[i] - x0;
+		double dy = (int64_t)(fclock.y[i] - y0);
+		double r = dy - intercept - fclock.slope * dx;
+
+		res += r * r;
+	}
+	fclock.jitter_ns = sqrt(res / fclock.n);
+}
+
+static void fclock_sample(const struct ai2_packet *pkt)
+{
+	uint32_t fcount;
+	int64_t x = 0;
+
+	if (pkt->len < 4)
+		return;
+
+	memcpy(&fcount, pkt->data, sizeof(fcount));
+	if (fclock.samples) {
+		int32_t delta = fcount - fclock.last;
+
+		/* later report of the same epoch */
+		if ((delta <= 0) && (delta > -10000))
+			return;
+
+		/* receiver restarted */
+		if (delta <= 0)
+			fclock.samples = fclock.n = fclock.head = 0;
+		else
+			x = fclock.fcount + delta;
+	}
+	if (!fclock.samples)
+		x = fcount;
+
+	fclock.last = fcount;
+	fclock.fcount = x;
+	fclock.x[fclock.head] = x;
+	fclock.y[fclock.head] = pkt->rx_ns;
+	fclock.head = (fclock.head + 1) % FCLOCK_WINDOW;
+	if (fclock.n < FCLOCK_WINDOW)
+		fclock.n++;
+
+	fclock.samples++;
+	fclock_fit();
+}
+
+static bool fclock_host_ns(uint32_t fcount, uint64_t *ns)
+{
+	int64_t x = fclock.fcount + (int32_t)(fcount - fclock.last);
+
+	if (fclock.n < 2)
+		return false;
+
+	*ns = fclock.base_ns + (int64_t)((x - fclock.base_fcount) * fclock.slope);
+	return true;
+}
+
+static void print_fclock_stats(void)
+{
+	fprintf(stderr, "fcount clock: samples: %lu drift: %.3f ppm jitter: %.1fus fcount 0 at: %.6fs\n",
+		fclock.samples, (fclock.slope / 1e6 - 1) * 1e6,
+		fclock.jitter_ns / 1000,
+		(fclock.base_ns - fclock.base_fcount * fclock.slope) / 1e9);
+}
+
+/*
+ * Per report type, consecutive fcounts are compared to find skipped,
+ * duplicate and reordered epochs, and against the host arrival times
+ * to see how much of the jitter comes from the host side.
+ */
+#define EPOCH_BUCKETS 24
+#define EPOCH_INTERVALS 8
+
+struct epoch_stats {
+	const char *name;
+	uint8_t type;
+	unsigned long count;
+	uint32_t last_fcount;
+	uint64_t last_rx;
+	unsigned long duplicates;
+	unsigned long reordered;
+	unsigned long restarts;
+	unsigned long gaps;
+	unsigned long missing;
+	/* most frequent intervals, the top one is taken as nominal */
+	struct {
+		uint32_t ms;
+		unsigned long count;
+	} intervals[EPOCH_INTERVALS];
+	/* [i] counts intervals below 2^i ms */
+	unsigned long interval_hist[EPOCH_BUCKETS];
+	/* [i] counts host - fcount interval differences below 2^i us */
+	unsigned long spread_hist[EPOCH_BUCKETS];
+	int64_t spread_min_us;
+	int64_t spread_max_us;
+};
+
+static struct epoch_stats epoch_stats[] = {
+	{ .name = "measurement", .type = AI2_MEASUREMENT },
+	{ .name = "position", .type = AI2_POSITION },
+	{ .name = "position_ext", .type = AI2_POSITION_EXT },
+	{ .name = "nmea", .type = AI2_NMEA },
+};
+
+static unsigned int log2_bucket(uint64_t v)
+{
+	unsigned int i = 0;
+
+	while (v && (i < EPOCH_BUCKETS - 1)) {
+		v >>= 1;
+		i++;
+	}
+	return i;
+}
+
+static uint32_t epoch_nominal(const struct epoch_stats *e)
+{
+	const typeof(e->intervals[0]) *best = &e->intervals[0];
+	int i;
+
+	for (i = 1; i < EPOCH_INTERVALS; i++)
+		if (e->intervals[i].count > best->count)
+			best = &e->intervals[i];
+
+	return best->ms;
+}
+
+/* keeps the most frequent intervals in constant space */
+static void epoch_count_interval(struct epoch_stats *e, uint32_t ms)
+{
+	typeof(e->intervals[0]) *min = &e->intervals[0];
+	int i;
+
+	for (i = 0; i < EPOCH_INTERVALS; i++) {
+		if (e->intervals[i].ms == ms) {
+			e->intervals[i].count++;
+			return;
+		}
+		if (e->intervals[i].count < min->count)
+			min = &e->intervals[i];
+	}
+	min->ms = ms;
+	min->count++;
+}
+
+static void epoch_sample(const struct ai2_packet *pkt)
+{
+	struct epoch_stats *e = NULL;
+	uint32_t fcount;
+	int32_t delta;
+	int64_t spread;
+	uint32_t nominal;
+	size_t i;
+
+	if (pkt->len < 4)
+		return;
+
+	for (i = 0; i < sizeof(epoch_stats) / sizeof(epoch_stats[0]); i++)
+		if (epoch_stats[i].type == pkt->type)
+			e = &epoch_stats[i];
+
+	if (!e)
+		return;
+
+	memcpy(&fcount, pkt->data, sizeof(fcount));
+	e->count++;
+	if (e->count == 1)
+		goto out;
+
+	delta = fcount - e->last_fcount;
+	if (!delta) {
+		e->duplicates++;
+		goto out;
+	}
+	/* receiver restarted, start over from this one like fclock_sample */
+	if (delta <= -10000) {
+		e->restarts++;
+		memset(e->intervals, 0, sizeof(e->intervals));
+		goto out;
+	}
+	if (delta < 0) {
+		e->reordered++;
+		/* keep comparing against the newest one */
+		return;
+	}
+
+	e->interval_hist[log2_bucket(delta)]++;
+	epoch_count_interval(e, delta);
+	nominal = epoch_nominal(e);
+	if (nominal && (delta > nominal + nominal / 2)) {
+		e->gaps++;
+		e->missing += (delta + nominal / 2) / nominal - 1;
+	}
+
+	spread = ((int64_t)(pkt->rx_ns - e->last_rx) - (int64_t)delta * 1000000) / 1000;
+	e->spread_hist[log2_bucket(spread < 0 ? -spread : spread)]++;
+	if ((e->count == 2) || (spread < e->spread_min_us))
+		e->spread_min_us = spread;
+	if ((e->count == 2) || (spread > e->spread_max_us))
+		e->spread_max_us = spread;
+out:
+	e->last_fcount = fcount;
+	e->last_rx = pkt->rx_ns;
+}
+
+static void print_hist(const char *prefix, const char *unit, const unsigned long *hist)
+{
+	int i;
+
+	fprintf(stderr, "%s", prefix);
+	for (i = 0; i < EPOCH_BUCKETS; i++)
+		if (hist[i])
+			fprintf(stderr, " <%u%s: %lu", 1u << i, unit, hist[i]);
+
+	fprintf(stderr, "\n");
+}
+
+static void print_epoch_stats(void)
+{
+	char prefix[64];
+	size_t i;
+
+	for (i = 0; i < sizeof(epoch_stats) / sizeof(epoch_stats[0]); i++) {
+		const struct epoch_stats *e = &epoch_stats[i];
+
+		if (!e->count)
+			continue;
+
+		fprintf(stderr, "epochs %s: reports: %lu nominal interval: %ums missing: %lu in %lu gaps duplicates: %lu reordered: %lu restarts: %lu host spread: %lld..%lldus\n",
+			e->name, e->count, epoch_nominal(e), e->missing, e->gaps,
+			e->duplicates, e->reordered, e->restarts,
+			(long long)e->spread_min_us, (long long)e->spread_max_us);
+		snprintf(prefix, sizeof(prefix), "epochs %s: intervals:", e->name);
+		print_hist(prefix, "ms", e->interval_hist);
+		snprintf(prefix, sizeof(prefix), "epochs %s: host spread:", e->name);
+		print_hist(prefix, "us", e->spread_hist);
+	}
+}
+
+/*
+ * Commands of class 1 ask for an ack (class 0 ones do not get any), and
+ * acks do not say what they are for, so they are matched in order
+ * against the outstanding commands. An error report answers the oldest
+ * one too.
+ */
+#define CMD_TYPES 32
+#define CMD_PENDING 32
+#define CMD_TIMEOUT_NS 5000000000ull
+
+struct cmd_rtt {
+	uint8_t class;
+	uint8_t cmd;
+	unsigned long sent;
+	unsigned long acked;
+	unsigned long errors;
+	unsigned long unanswered;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	/* [i] counts round trips below 2^i us */
+	unsigned long hist[EPOCH_BUCKETS];
+};
+
+static struct {
+#ifndef NO_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct cmd_rtt types[CMD_TYPES];
+	int ntypes;
+	struct {
+		struct cmd_rtt *c;
+		uint64_t sent_ns;
+	} pending[CMD_PENDING];
+	int head;
+	int npending;
+	unsigned long unexpected;
+} cmds = {
+#ifndef NO_THREADS
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void cmds_lock(void)
+{
+#ifndef NO_THREADS
+	pthread_mutex_lock(&cmds.lock);
+#endif
+}
+
+static void cmds_unlock(void)
+{
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&cmds.lock);
+#endif
+}
+
+static struct cmd_rtt *cmd_type(uint8_t class, uint8_t cmd)
+{
+	int i;
+
+	for (i = 0; i < cmds.ntypes; i++)
+		if ((cmds.types[i].class == class) && (cmds.types[i].cmd == cmd))
+			return &cmds.types[i];
+
+	if (cmds.ntypes == CMD_TYPES)
+		return NULL;
+
+	cmds.types[cmds.ntypes].class = class;
+	cmds.types[cmds.ntypes].cmd = cmd;
+	return &cmds.types[cmds.ntypes++];
+}
+
+/* drops everything which waited too long, call with the lock held */
+static void cmds_expire(uint64_t now)
+{
+	while (cmds.npending && (now - cmds.pending[cmds.head].sent_ns > CMD_TIMEOUT_NS)) {
+		cmds.pending[cmds.head].c->unanswered++;
+		cmds.head = (cmds.head + 1) % CMD_PENDING;
+		cmds.npending--;
+	}
+}
+
+/*
+ * called before the write, the answer may be processed before write()
+ * returns, returns the time it is queued with for cmd_unsent()
+ */
+static uint64_t cmd_sent(uint8_t class, uint8_t cmd)
+{
+	uint64_t now = now_ns();
+	struct cmd_rtt *c;
+
+	cmds_lock();
+	cmds_expire(now);
+	c = cmd_type(class, cmd);
+	if (c) {
+		c->sent++;
+		if (class == AI2_CLASS_ACKREQ) {
+			int tail = (cmds.head + cmds.npending) % CMD_PENDING;
+
+			if (cmds.npending == CMD_PENDING) {
+				/* oldest one is not going to be answered any more */
+				cmds.pending[cmds.head].c->unanswered++;
+				cmds.head = (cmds.head + 1) % CMD_PENDING;
+				cmds.npending--;
+				tail = (cmds.head + cmds.npending) % CMD_PENDING;
+			}
+			cmds.pending[tail].c = c;
+			cmds.pending[tail].sent_ns = now;
+			cmds.npending++;
+		}
+	}
+	cmds_unlock();
+	return now;
+}
+
+/* the write failed after all, take it back */
+static void cmd_unsent(uint8_t class, uint8_t cmd, uint64_t sent_ns)
+{
+	struct cmd_rtt *c;
+
+	cmds_lock();
+	c = cmd_type(class, cmd);
+	if (c) {
+		c->sent--;
+		if (cmds.npending) {
+			int last = (cmds.head + cmds.npending - 1) % CMD_PENDING;
+
+			if ((cmds.pending[last].c == c) && (cmds.pending[last].sent_ns == sent_ns))
+				cmds.npending--;
+		}
+	}
+	cmds_unlock();
+}
+
+static void cmd_answered(uint64_t rx_ns, bool error)
+{
+	struct cmd_rtt *c;
+	uint64_t rtt;
+
+	cmds_lock();
+	cmds_expire(rx_ns);
+	if (!cmds.npending) {
+		cmds.unexpected++;
+		cmds_unlock();
+		return;
+	}
+
+	c = cmds.pending[cmds.head].c;
+	rtt = rx_ns - cmds.pending[cmds.head].sent_ns;
+	cmds.head = (cmds.head + 1) % CMD_PENDING;
+	cmds.npending--;
+	if (error)
+		c->errors++;
+	else
+		c->acked++;
+
+	c->total_ns += rtt;
+	if (rtt > c->max_ns)
+		c->max_ns = rtt;
+
+	c->hist[log2_bucket(rtt / 1000)]++;
+	cmds_unlock();
+}
+
+static void cmd_error(const struct ai2_packet *pkt)
+{
+	cmd_answered(pkt->rx_ns, true);
+}
+
+static void print_cmd_stats(void)
+{
+	char prefix[64];
+	int i;
+
+	cmds_lock();
+	cmds_expire(now_ns());
+	for (i = 0; i < cmds.ntypes; i++) {
+		const struct cmd_rtt *c = &cmds.types[i];
+		unsigned long answered = c->acked + c->errors;
+
+		fprintf(stderr, "command %02x %02x: sent: %lu acked: %lu errors: %lu unanswered: %lu rtt avg: %.1fms max: %.1fms\n",
+			c->class, c->cmd, c->sent, c->acked, c->errors,
+			c->unanswered,
+			answered ? (double)c->total_ns / answered / 1e6 : 0.0,
+			(double)c->max_ns / 1e6);
+		if (answered) {
+			snprintf(prefix, sizeof(prefix), "command %02x %02x: rtt:", c->class, c->cmd);
+			print_hist(prefix, "us", c->hist);
+		}
+	}
+	if (cmds.npending || cmds.unexpected)
+		fprintf(stderr, "commands: pending: %d unexpected answers: %lu\n",
+			cmds.npending, cmds.unexpected);
+	cmds_unlock();
+}
+
+/* the segment ntpd's and chrony's SHM refclock driver read */
+#define NTPD_SHM_BASE 0x4e545030
+
+struct shm_time {
+	int mode;
+	volatile int count;
+	time_t clock_sec;
+	int clock_usec;
+	time_t receive_sec;
+	int receive_usec;
+	int leap;
+	int precision;
+	int nsamples;
+	volatile int valid;
+	unsigned clock_nsec;
+	unsigned receive_nsec;
+	int dummy[8];
+};
+
+static int shm_unit = -1;
+static struct shm_time *shm;
+
+static int shm_setup(void)
+{
+	/* units 0 and 1 are for root only */
+	int id = shmget(NTPD_SHM_BASE + shm_unit, sizeof(struct shm_time),
+			IPC_CREAT | (shm_unit < 2 ? 0600 : 0666));
+
+	if (id < 0) {
+		perror("shmget");
+		return -1;
+	}
+
+	shm = shmat(id, NULL, 0);
+	if (shm == (void *)-1) {
+		perror("shmat");
+		shm = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* UTC of the fix in a valid RMC sentence */
+static bool nmea_rmc_time(const char *s, size_t len, struct timespec *ts)
+{
+	const char *p = memmem(s, len, "RMC,", 4);
+	char buf[128];
+	char *fields[10];
+	char *f = buf;
+	struct tm tm = {0};
+	double frac;
+	size_t n;
+	int i;
+
+	if (!p)
+		return false;
+
+	len -= p - s;
+	for (n = 0; (n < len) && (n < sizeof(buf) - 1) && (p[n] != '*') && (p[n] != '\r'); n++)
+		buf[n] = p[n];
+
+	buf[n] = 0;
+	for (i = 0; i < 10; i++) {
+		fields[i] = strsep(&f, ",");
+		if (!fields[i])
+			return false;
+	}
+
+	/* RMC,hhmmss.ss,A,lat,N,lon,E,speed,course,ddmmyy */
+	if (strcmp(fields[2], "A") ||
+	    (sscanf(fields[1], "%2d%2d%2d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 3) ||
+	    (sscanf(fields[9], "%2d%2d%2d", &tm.tm_mday, &tm.tm_mon, &tm.tm_year) != 3))
+		return false;
+
+	tm.tm_mon--;
+	tm.tm_year += 100;
+	frac = strlen(fields[1]) > 6 ? atof(fields[1] + 6) : 0;
+	ts->tv_sec = timegm(&tm);
+	ts->tv_nsec = frac * 1e9;
+	return true;
+}
+
+static void shm_publish(const struct timespec *clock, uint64_t receive_ns)
+{
+	double jitter = fclock.jitter_ns / 1e9;
+	int precision = 0;
+
+	while ((jitter < 0.5) && (precision > -30)) {
+		jitter *= 2;
+		precision--;
+	}
+
+	shm->valid = 0;
+	shm->count++;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	shm->mode = 1;
+	shm->clock_sec = clock->tv_sec;
+	shm->clock_usec = clock->tv_nsec / 1000;
+	shm->clock_nsec = clock->tv_nsec;
+	shm->receive_sec = receive_ns / 1000000000ull;
+	shm->receive_usec = receive_ns % 1000000000ull / 1000;
+	shm->receive_nsec = receive_ns % 1000000000ull;
+	shm->leap = 0;
+	shm->precision = precision;
+	shm->nsamples = 3;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	shm->count++;
+	shm->valid = 1;
+}
+
+/*
+ * The fix time from the RMC sentence against the host's CLOCK_REALTIME
+ * at the moment the model says the epoch with that fcount happened.
+ */
+static void shm_nmea(const struct ai2_packet *pkt)
+{
+	const struct nmea *p = (const struct nmea *) pkt->data;
+	struct timespec gps, mono, real;
+	uint64_t host_ns;
+
+	if (pkt->len < 4)
+		return;
+
+	if (!nmea_rmc_time(p->nmea, pkt->len - 4, &gps))
+		return;
+
+	if (!fclock_host_ns(p->fcount, &host_ns))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	shm_publish(&gps, ts_to_ns(&real) + (int64_t)(host_ns - ts_to_ns(&mono)));
+}
+
+/*
+ * Decoded epochs in the columnar format of archive.h. Measurement and
+ * position are joined by fcount, an epoch becomes a row when a report
+ * of another one arrives. Blocks are written when full, after
+ * ARCHIVE_FLUSH_NS at the latest, and at exit.
+ */
+#define ARCHIVE_FLUSH_NS (600 * 1000000000ull)
+
+static const char *archive_path;
+static FILE *archive_file;
+static int64_t archive_realtime;
+static uint64_t archive_started;
+static unsigned int archive_rows;
+
+static struct {
+	int64_t *v;
+	size_t count;
+	size_t size;
+} archive_columns[ARCHIVE_COLUMNS];
+
+static struct {
+	bool have;
+	uint32_t fcount;
+	uint64_t rx_ns;
+	unsigned int flags;
+	int32_t lat;
+	int32_t lon;
+	int16_t alt;
+	unsigned int nsv;
+} archive_epoch;
+
+static void archive_push(int column, int64_t v)
+{
+	typeof(archive_columns[0]) *c = &archive_columns[column];
+
+	if (c->count == c->size) {
+		c->size = c->size ? 2 * c->size : ARCHIVE_ROWS;
+		c->v = realloc(c->v, c->size * sizeof(*c->v));
+		if (!c->v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	c->v[c->count++] = v;
+}
+
+static void archive_flush(void)
+{
+	struct archive_block block = {
+		.rows = archive_rows,
+		.svs = archive_columns[ARCHIVE_SV].count,
+		.columns = ARCHIVE_COLUMNS,
+	};
+	uint8_t *raw = NULL, *packed = NULL;
+	int i;
+
+	if (!archive_rows)
+		return;
+
+	fwrite(&block, sizeof(block), 1, archive_file);
+	for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+		typeof(archive_columns[0]) *c = &archive_columns[i];
+		struct archive_column col = { .id = i };
+		unsigned int flag = archive_column_flag(i);
+		bool first = true;
+		uLongf len;
+		int64_t prev = 0;
+		uint8_t *p;
+		size_t j;
+
+		raw = realloc(raw, c->count * 10 + 1);
+		len = compressBound(c->count * 10 + 1);
+		packed = realloc(packed, len);
+		if (!raw || !packed) {
+			perror("realloc");
+			exit(1);
+		}
+
+		for (p = raw, j = 0; j < c->count; j++) {
+			if (!flag || (archive_columns[ARCHIVE_FLAGS].v[j] & flag)) {
+				if (first || (c->v[j] < col.min))
+					col.min = c->v[j];
+				if (first || (c->v[j] > col.max))
+					col.max = c->v[j];
+				first = false;
+			}
+			p = varint_encode(p, zigzag_encode(c->v[j] - prev));
+			prev = c->v[j];
+		}
+
+		if (compress2(packed, &len, raw, p - raw, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			fprintf(stderr, "archive: compression failed\n");
+			exit(1);
+		}
+
+		col.rawlen = p - raw;
+		col.len = len;
+		fwrite(&col, sizeof(col), 1, archive_file);
+		fwrite(packed, 1, len, archive_file);
+		c->count = 0;
+	}
+	free(raw);
+	free(packed);
+
+	if (fflush(archive_file))
+		perror(archive_path);
+
+	archive_rows = 0;
+}
+
+static void archive_commit(void)
+{
+	archive_push(ARCHIVE_FCOUNT, archive_epoch.fcount);
+	archive_push(ARCHIVE_TIME, archive_epoch.rx_ns + archive_realtime);
+	archive_push(ARCHIVE_FLAGS, archive_epoch.flags);
+	archive_push(ARCHIVE_LAT, archive_epoch.lat);
+	archive_push(ARCHIVE_LON, archive_epoch.lon);
+	archive_push(ARCHIVE_ALT, archive_epoch.alt);
+	archive_push(ARCHIVE_NSV, archive_epoch.nsv);
+	archive_epoch.have = false;
+
+	if (!archive_rows)
+		archive_started = archive_epoch.rx_ns;
+	archive_rows++;
+	if ((archive_rows == ARCHIVE_ROWS) ||
+	    (archive_epoch.rx_ns - archive_started >= ARCHIVE_FLUSH_NS))
+		archive_flush();
+}
+
+static void archive_report(const struct ai2_packet *pkt)
+{
+	uint32_t fcount;
+
+	if (pkt->len < 4)
+		return;
+
+	memcpy(&fcount, pkt->data, sizeof(fcount));
+	if (archive_epoch.have && (archive_epoch.fcount != fcount))
+		archive_commit();
+
+	if (!archive_epoch.have) {
+		memset(&archive_epoch, 0, sizeof(archive_epoch));
+		archive_epoch.have = true;
+		archive_epoch.fcount = fcount;
+		archive_epoch.rx_ns = pkt->rx_ns;
+	}
+
+	if ((pkt->type == AI2_POSITION) && (pkt->len >= sizeof(struct position))) {
+		const struct position *p = (const struct position *)pkt->data;
+
+		archive_epoch.lat = p->lat;
+		archive_epoch.lon = p->lon;
+		archive_epoch.alt = p->altitude;
+		archive_epoch.flags |= ARCHIVE_FLAG_POSITION | ARCHIVE_FLAG_ALTITUDE;
+	}
+
+	if ((pkt->type == AI2_POSITION_EXT) && (pkt->len >= sizeof(struct position_ext))) {
+		const struct position_ext *p = (const struct position_ext *)pkt->data;
+
+		archive_epoch.lat = p->lat;
+		archive_epoch.lon = p->lon;
+		archive_epoch.flags |= ARCHIVE_FLAG_POSITION;
+	}
+
+	if (pkt->type == AI2_MEASUREMENT) {
+		const struct measurement_sv *m = (const struct measurement_sv *)pkt->data;
+		int sats = (pkt->len - 4) / sizeof(m->svdata[0]);
+		int i;
+
+		/* straight into the columns, the row follows */
+		for (i = 0; i < sats; i++) {
+			archive_push(ARCHIVE_SV, m->svdata[i].sv);
+			archive_push(ARCHIVE_SNR, m->svdata[i].snr);
+			archive_push(ARCHIVE_CNO, m->svdata[i].cno);
+		}
+		archive_epoch.nsv += sats;
+		archive_epoch.flags |= ARCHIVE_FLAG_MEASUREMENT;
+	}
+}
+
+static void archive_close(void)
+{
+	if (archive_epoch.have)
+		archive_commit();
+
+	archive_flush();
+	if (fclose(archive_file))
+		perror(archive_path);
+}
+
+static int archive_setup(void)
+{
+	struct archive_header header = {
+		.magic = ARCHIVE_MAGIC,
+		.version = ARCHIVE_VERSION,
+	};
+	struct archive_header old;
+
+	/* blocks are appended to an existing archive */
+	archive_file = fopen(archive_path, "a+");
+	if (!archive_file) {
+		perror(archive_path);
+		return -1;
+	}
+
+	fseek(archive_file, 0, SEEK_END);
+	if (!ftell(archive_file)) {
+		fwrite(&header, sizeof(header), 1, archive_file);
+	} else {
+		rewind(archive_file);
+		if ((fread(&old, sizeof(old), 1, archive_file) != 1) ||
+		    memcmp(&old, &header, sizeof(header))) {
+			fprintf(stderr, "%s: not an archive of version %d\n",
+				archive_path, ARCHIVE_VERSION);
+			fclose(archive_file);
+			return -1;
+		}
+		fseek(archive_file, 0, SEEK_END);
+	}
+
+	archive_realtime = realtime_offset();
+	atexit(archive_close);
+	return 0;
+}
+
+/*
+ * Fixed size records of gps-record.h, flushed after each position so
+ * consumers get every epoch as soon as it is complete.
+ */
+static const char *binout_path;
+static FILE *binout;
+static int64_t binout_realtime;
+
+static void binout_write(struct gps_record *r, uint16_t type, uint32_t fcount, uint64_t rx_ns)
+{
+	r->type = type;
+	r->version = GPS_RECORD_VERSION;
+	r->fcount = fcount;
+	r->time_ns = rx_ns + binout_realtime;
+	if (fwrite(r, sizeof(*r), 1, binout) != 1) {
+		perror(binout_path);
+		exit(1);
+	}
+}
+
+static void binout_position(const struct ai2_packet *pkt)
+{
+	struct gps_record r = { 0 };
+	uint32_t fcount;
+	int32_t lat, lon;
+	size_t head;
+
+	if (pkt->type == AI2_POSITION) {
+		const struct position *p = (const struct position *)pkt->data;
+
+		if (pkt->len < sizeof(*p))
+			return;
+
+		r.position.alt = (double)p->altitude / 2.0;
+		r.position.flags = GPS_RECORD_FLAG_ALT;
+		head = offsetof(struct position, svdata);
+		r.position.nsv = (pkt->len - head) / sizeof(p->svdata[0]);
+		fcount = p->fcount;
+		lat = p->lat;
+		lon = p->lon;
+	} else {
+		const struct position_ext *p = (const struct position_ext *)pkt->data;
+
+		if (pkt->len < sizeof(*p))
+			return;
+
+		head = offsetof(struct position_ext, svdata);
+		r.position.nsv = (pkt->len - head) / sizeof(p->svdata[0]);
+		fcount = p->fcount;
+		lat = p->lat;
+		lon = p->lon;
+	}
+
+	r.position.lat = 90 * (double)lat / 2147483648.0;
+	r.position.lon = 180 * (double)lon / 2147483648.0;
+	binout_write(&r, GPS_RECORD_POSITION, fcount, pkt->rx_ns);
+	if (!wakeup_budget)
+		fflush(binout);
+}
+
+static void binout_measurement(const struct ai2_packet *pkt)
+{
+	const struct measurement_sv *m = (const struct measurement_sv *)pkt->data;
+	struct gps_record r = { 0 };
+	int sats, i;
+
+	if (pkt->len < 4)
+		return;
+
+	sats = (pkt->len - 4) / sizeof(m->svdata[0]);
+	r.measurement.nsv = sats;
+	binout_write(&r, GPS_RECORD_MEASUREMENT, m->fcount, pkt->rx_ns);
+	for (i = 0; i < sats; i++) {
+		memset(&r, 0, sizeof(r));
+		r.sv.sv = m->svdata[i].sv;
+		r.sv.index = i;
+		r.sv.snr = m->svdata[i].snr / 10.0f;
+		r.sv.cno = m->svdata[i].cno / 10.0f;
+		binout_write(&r, GPS_RECORD_SV, m->fcount, pkt->rx_ns);
+	}
+}
+
+static int binout_setup(void)
+{
+	struct gps_record r = {
+		.file = {
+			.magic = GPS_RECORD_MAGIC,
+			.size = GPS_RECORD_SIZE,
+		},
+	};
+
+	if (binout_stdout) {
+		binout = stdout;
+	} else {
+		binout = fopen(binout_path, "w");
+		if (!binout) {
+			perror(binout_path);
+			return -1;
+		}
+	}
+
+	binout_realtime = realtime_offset();
+	binout_write(&r, GPS_RECORD_FILE, 0, now_ns());
+	fflush(binout);
+	return 0;
+}
+
+/* handlers for all classes, set up once at startup */
+static void subscribe(uint8_t type, packet_handler fn)
+{
+	if (register_handler(AI2_ANY_CLASS, type, fn)) {
+		fprintf(stderr, "too many handlers for type %02x, at most %d\n",
+			type, MAX_HANDLERS);
+		exit(1);
+	}
+}
+
+static void register_decoder(uint8_t type, packet_handler fn)
+{
+	if (!positions_only && LOG_ON(LOG_VERBOSE, LOG_PACKETS))
+		subscribe(type, print_packet_info);
+
+	subscribe(type, fn);
+}
+
+static void setup_handlers(void)
+{
+	if (noprocess) {
+		default_handler = dump_packet;
+		return;
+	}
+
+	if (template) {
+		/* nothing else is decoded */
+		subscribe(AI2_POSITION, template_position);
+		subscribe(AI2_POSITION_EXT, template_position);
+		if (nmeaout)
+			subscribe(AI2_NMEA, process_nmea);
+	} else if (jsonout) {
+		subscribe(AI2_POSITION, json_position);
+		subscribe(AI2_POSITION_EXT, json_position);
+		if (nmeaout)
+			subscribe(AI2_NMEA, process_nmea);
+
+		if (!positions_only) {
+			subscribe(AI2_MEASUREMENT, json_measurement);
+			subscribe(AI2_ASYNC_EVENT, json_event);
+			subscribe(AI2_ERROR, json_error);
+		}
+	} else {
+		register_decoder(AI2_POSITION, process_position);
+		register_decoder(AI2_POSITION_EXT, process_position_ext);
+		if (!positions_only || nmeaout)
+			register_decoder(AI2_NMEA, process_nmea);
+
+		if (!positions_only) {
+			register_decoder(AI2_MEASUREMENT, process_measurement);
+			register_decoder(AI2_ASYNC_EVENT, process_async_event);
+			register_decoder(AI2_ERROR, process_error);
+			if (LOG_ON(LOG_INFO, LOG_PACKETS))
+				default_handler = hexunknown ? print_unknown_hex : print_unknown;
+		}
+	}
+
+	if (showstats || (shm_unit >= 0)) {
+		subscribe(AI2_MEASUREMENT, fclock_sample);
+		subscribe(AI2_POSITION, fclock_sample);
+		subscribe(AI2_POSITION_EXT, fclock_sample);
+		subscribe(AI2_NMEA, fclock_sample);
+	}
+
+	if (showstats) {
+		subscribe(AI2_MEASUREMENT, epoch_sample);
+		subscribe(AI2_POSITION, epoch_sample);
+		subscribe(AI2_POSITION_EXT, epoch_sample);
+		subscribe(AI2_NMEA, epoch_sample);
+	}
+
+	if (shm_unit >= 0)
+		subscribe(AI2_NMEA, shm_nmea);
+
+	if (archive_path) {
+		subscribe(AI2_MEASUREMENT, archive_report);
+		subscribe(AI2_POSITION, archive_report);
+		subscribe(AI2_POSITION_EXT, archive_report);
+	}
+
+	if (binout_path) {
+		subscribe(AI2_MEASUREMENT, binout_measurement);
+		subscribe(AI2_POSITION, binout_position);
+		subscribe(AI2_POSITION_EXT, binout_position);
+	}
+
+	if (showstats)
+		subscribe(AI2_ERROR, cmd_error);
+}
+
+/* "packet cc tt" for the trace, filled on first use */
+static const char *trace_packet_name(uint8_t class, uint8_t type)
+{
+	static char names[AI2_CLASSES][256][16];
+
+	if (class >= AI2_CLASSES)
+		return "packet";
+
+	if (!names[class][type][0])
+		snprintf(names[class][type], sizeof(names[class][type]),
+			 "packet %02x %02x", class, type);
+	return names[class][type];
+}
+
+/*
+ * What the handlers of each (class, type) cost, kept with stats.
+ * Packets of classes beyond AI2_CLASSES share an extra row, printed
+ * as class "other".
+ */
+struct handler_cost {
+	unsigned long calls;
+	unsigned long bytes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static struct handler_cost handler_costs[AI2_CLASSES + 1][256];
+
+static void handler_cost_add(const struct ai2_packet *pkt, uint64_t ns)
+{
+	uint8_t class = pkt->class < AI2_CLASSES ? pkt->class : AI2_CLASSES;
+	struct handler_cost *c = &handler_costs[class][pkt->type];
+
+	c->calls++;
+	c->bytes += pkt->len;
+	c->total_ns += ns;
+	if (ns > c->max_ns)
+		c->max_ns = ns;
+}
+
+static int cmp_handler_cost(const void *a, const void *b)
+{
+	const struct handler_cost *x = *(const struct handler_cost * const *)a;
+	const struct handler_cost *y = *(const struct handler_cost * const *)b;
+
+	return (x->total_ns < y->total_ns) - (x->total_ns > y->total_ns);
+}
+
+/* most expensive first */
+static void print_handler_costs(void)
+{
+	static const struct handler_cost *sorted[(AI2_CLASSES + 1) * 256];
+	const struct handler_cost *c;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < (AI2_CLASSES + 1) * 256; i++)
+		if (handler_costs[i / 256][i % 256].calls)
+			sorted[n++] = &handler_costs[i / 256][i % 256];
+
+	qsort(sorted, n, sizeof(sorted[0]), cmp_handler_cost);
+	for (i = 0; i < n; i++) {
+		char class[8];
+		ptrdiff_t idx;
+
+		c = sorted[i];
+		idx = c - &handler_costs[0][0];
+		if (idx / 256 < AI2_CLASSES)
+			snprintf(class, sizeof(class), "%02x", (int)(idx / 256));
+		else
+			strcpy(class, "other");
+		fprintf(stderr, "handlers %s %02x: calls: %lu bytes: %lu total: %.3fms avg: %.2fus max: %.2fus\n",
+			class, (int)(idx % 256), c->calls, c->bytes,
+			c->total_ns / 1e6, c->total_ns / 1e3 / c->calls,
+			c->max_ns / 1e3);
+	}
+}
+
+/*
+ * Catalog of every (class, type) seen, kept in a text file across
+ * runs: loaded at startup, counts of this run are added and the whole
+ * thing is written back at exit and, by the signal thread, every
+ * CATALOG_SAVE_NS. Payload
+ * lengths are counted for the most frequent CATALOG_LENS ones only,
+ * a rare length may take the place of the least frequent one.
+ */
+#define CATALOG_LENS 8
+#define CATALOG_SAMPLE 32
+#define CATALOG_SAVE_NS 10000000000ull
+
+struct catalog_entry {
+	unsigned long count;
+	unsigned int min_len;
+	unsigned int max_len;
+	bool have_fcount;
+	uint32_t first_fcount;
+	uint32_t last_fcount;
+	struct {
+		unsigned int len;
+		unsigned long count;
+	} lens[CATALOG_LENS];
+	unsigned int sample_len;
+	uint8_t sample[CATALOG_SAMPLE];
+};
+
+static const char *catalog_path;
+static struct catalog_entry catalog[AI2_CLASSES][256];
+#ifndef NO_THREADS
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+/* of the latest report carrying one */
+static bool catalog_have_fcount;
+static uint32_t catalog_fcount;
+
+static void catalog_lock(void)
+{
+#ifndef NO_THREADS
+	pthread_mutex_lock(&catalog_mutex);
+#endif
+}
+
+static void catalog_unlock(void)
+{
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&catalog_mutex);
+#endif
+}
+
+static void catalog_count_len(struct catalog_entry *e, unsigned int len, unsigned long count)
+{
+	int i, min = 0;
+
+	for (i = 0; i < CATALOG_LENS; i++) {
+		if (e->lens[i].count && (e->lens[i].len == len)) {
+			e->lens[i].count += count;
+			return;
+		}
+		if (e->lens[i].count < e->lens[min].count)
+			min = i;
+	}
+	/* like space saving: the newcomer inherits the count it replaces */
+	if (e->lens[min].count)
+		count += e->lens[min].count;
+	e->lens[min].len = len;
+	e->lens[min].count = count;
+}
+
+static unsigned int catalog_modal_len(const struct catalog_entry *e)
+{
+	int i, max = 0;
+
+	for (i = 1; i < CATALOG_LENS; i++)
+		if (e->lens[i].count > e->lens[max].count)
+			max = i;
+
+	return e->lens[max].len;
+}
+
+static void catalog_load(void)
+{
+	FILE *f = fopen(catalog_path, "r");
+	char *line = NULL;
+	size_t size = 0;
+
+	if (!f)
+		return;
+
+	while (getline(&line, &size, f) > 0) {
+		struct catalog_entry *e;
+		unsigned int class, type, min, max, modal, len;
+		unsigned long count;
+		char first[16], last[16];
+		char *p;
+		int pos;
+
+		/* the modal length follows from the counts */
+		if ((sscanf(line, "%x %x %lu %u %u %u %15s %15s %n", &class, &type,
+			    &count, &min, &max, &modal, first, last, &pos) != 8) ||
+		    (class >= AI2_CLASSES) || (type > 255))
+			continue;
+
+		e = &catalog[class][type];
+		e->count = count;
+		e->min_len = min;
+		e->max_len = max;
+		e->have_fcount = strcmp(first, "-");
+		e->first_fcount = strtoul(first, NULL, 0);
+		e->last_fcount = strtoul(last, NULL, 0);
+
+		p = line + pos;
+		while (sscanf(p, "%u:%lu%n", &len, &count, &pos) == 2) {
+			catalog_count_len(e, len, count);
+			p += pos;
+			if (*p == ',')
+				p++;
+		}
+
+		while (isspace(*p))
+			p++;
+		for (e->sample_len = 0; e->sample_len < CATALOG_SAMPLE; e->sample_len++) {
+			if (sscanf(p, "%2hhx", &e->sample[e->sample_len]) != 1)
+				break;
+			p += 2;
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Written from a copy, the reader only waits for that. The signal
+ * thread and exit() may both get here, they take turns.
+ */
+static void catalog_save(void)
+{
+#ifndef NO_THREADS
+	static pthread_mutex_t saving = PTHREAD_MUTEX_INITIALIZER;
+#endif
+	static struct catalog_entry copy[AI2_CLASSES][256];
+	char tmp[4096];
+	FILE *f;
+	int class, type, i;
+
+#ifndef NO_THREADS
+	pthread_mutex_lock(&saving);
+#endif
+	catalog_lock();
+	memcpy(copy, catalog, sizeof(copy));
+	catalog_unlock();
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", catalog_path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		goto out;
+	}
+
+	fprintf(f, "# class type count minlen maxlen modallen firstfcount lastfcount len:count,... sample\n");
+	for (class = 0; class < AI2_CLASSES; class++) {
+		for (type = 0; type < 256; type++) {
+			const struct catalog_entry *e = &copy[class][type];
+			char sample[2 * CATALOG_SAMPLE + 1];
+			bool first = true;
+
+			if (!e->count)
+				continue;
+
+			fprintf(f, "%02x %02x %lu %u %u %u ", class, type, e->count,
+				e->min_len, e->max_len, catalog_modal_len(e));
+			if (e->have_fcount)
+				fprintf(f, "%u %u ", e->first_fcount, e->last_fcount);
+			else
+				fprintf(f, "- - ");
+
+			for (i = 0; i < CATALOG_LENS; i++) {
+				if (!e->lens[i].count)
+					continue;
+
+				fprintf(f, "%s%u:%lu", first ? "" : ",", e->lens[i].len,
+					e->lens[i].count);
+				first = false;
+			}
+
+			*hex_encode(sample, e->sample, e->sample_len) = 0;
+			fprintf(f, " %s\n", e->sample_len ? sample : "-");
+		}
+	}
+
+	if (fclose(f) || rename(tmp, catalog_path))
+		perror(catalog_path);
+out:
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&saving);
+#endif
+	return;
+}
+
+static void catalog_add(const struct ai2_packet *pkt)
+{
+	struct catalog_entry *e;
+
+	if (pkt->class >= AI2_CLASSES)
+		return;
+
+	catalog_lock();
+	switch (pkt->type) {
+	case AI2_MEASUREMENT:
+	case AI2_POSITION:
+	case AI2_POSITION_EXT:
+	case AI2_NMEA:
+		if (pkt->len >= 4) {
+			memcpy(&catalog_fcount, pkt->data, sizeof(catalog_fcount));
+			catalog_have_fcount = true;
+		}
+		break;
+	}
+
+	e = &catalog[pkt->class][pkt->type];
+	if (!e->count) {
+		e->min_len = pkt->len;
+		e->max_len = pkt->len;
+	}
+	if (pkt->len < e->min_len)
+		e->min_len = pkt->len;
+	if (pkt->len > e->max_len)
+		e->max_len = pkt->len;
+	if (catalog_have_fcount) {
+		if (!e->have_fcount)
+			e->first_fcount = catalog_fcount;
+		e->last_fcount = catalog_fcount;
+		e->have_fcount = true;
+	}
+	if (!e->sample_len && pkt->len) {
+		e->sample_len = pkt->len < CATALOG_SAMPLE ? pkt->len : CATALOG_SAMPLE;
+		memcpy(e->sample, pkt->data, e->sample_len);
+	}
+	catalog_count_len(e, pkt->len, 1);
+	e->count++;
+	catalog_unlock();
+}
+
+static void catalog_setup(void)
+{
+	catalog_load();
+	atexit(catalog_save);
+}
+
+static void call_handlers(const struct ai2_packet *pkt)
+{
+	const struct handler_list *h;
+	uint64_t start;
+	int i;
+
+	if (!is_subscribed(pkt->class, pkt->type)) {
+		if (default_handler) {
+			start = trace_start();
+			default_handler(pkt);
+			if (tracing)
+				trace_record(trace_packet_name(pkt->class, pkt->type), start, pkt->len);
+		}
+		return;
+	}
+
+	h = &dispatch[pkt->class][pkt->type];
+	for (i = 0; i < h->count; i++) {
+		start = trace_start();
+		h->fn[i](pkt);
+		if (tracing)
+			trace_record(trace_packet_name(pkt->class, pkt->type), start, pkt->len);
+	}
+}
+
+static void process_packet(const struct ai2_packet *pkt)
+{
+	uint64_t start;
+
+	if (catalog_path)
+		catalog_add(pkt);
+
+	if (!showstats) {
+		call_handlers(pkt);
+		return;
+	}
+
+	start = now_ns();
+	call_handlers(pkt);
+	handler_cost_add(pkt, now_ns() - start);
+}
+
+static int append_packet(uint8_t *pkt, int pktpos, uint8_t data)
+{
+	pkt[pktpos] = data;
+	pktpos++;
+	if (data == 0x10) {
+		pkt[pktpos] = data;
+		pktpos++;
+	}
+	return pktpos;
+}
+
+static int write_packet(int fd, uint8_t class, uint8_t cmd, uint8_t *data, uint16_t len)
+{
+	uint8_t *pkt = calloc(1, 4 + len * 2  + 2);
+	uint64_t start, sent_ns;
+	int i;
+	int ret;
+	uint16_t sum;
+	int pktpos = 2;
+	pkt[0] = 0x10;
+	pkt[1] = class;
+
+	sum = 0x10 + class + cmd;
+	sum += len & 0xff;
 	sum += len >> 8;
 
-	pktpos = append_packet(pkt, pktpos, cmd);
-	pktpos = append_packet(pkt, pktpos, len & 0xff);
-	pktpos = append_packet(pkt, pktpos, len >> 8);
+	pktpos = append_packet(pkt, pktpos, cmd);
+	pktpos = append_packet(pkt, pktpos, len & 0xff);
+	pktpos = append_packet(pkt, pktpos, len >> 8);
+
+	for (i = 0; i < len; i++) {
+		pktpos = append_packet(pkt, pktpos, data[i]);
+		sum += data[i];
+	}
+
+	pkt[pktpos] = sum & 0xff;
+	pktpos++;
+
+	pkt[pktpos] = sum >> 8;
+	pktpos++;
+
+	pkt[pktpos] = 0x10;
+	pktpos++;
+	pkt[pktpos] = 0x03;
+	pktpos++;
+
+	sent_ns = cmd_sent(class, cmd);
+	start = trace_start();
+	ret = write(fd, pkt, pktpos);
+	trace_end("write", start, pktpos);
+	if (ret <= 0)
+		cmd_unsent(class, cmd, sent_ns);
+
+	free(pkt);
+	return ret;
+}
+
+static int set_receiver_state(int fd, uint8_t state)
+{
+	return write_packet(fd, 1, AI2_CMD_RECEIVER_STATE, &state, 1);
+}
+
+static int enable_nmea_reports(int fd, uint8_t mask)
+{
+	uint8_t buf[4] = {0};
+	buf[0] = mask;
+	return write_packet(fd, 1, AI2_CMD_NMEA_REPORTS, buf, sizeof(buf));
+}
+
+#define WRITE_PKT(fd, class, type, data) do { uint8_t d[] = data; write_packet(fd, (class), (type), d, sizeof(d)); } while(0)
+
+static void write_init(int fd, bool nmea)
+{
+#if 0
+	uint8_t init_nmea[] = {
+		0x10, 0x01, 0x08, 0x18, 0x00, 0x00, 0x01, 0x3c, 0x01, 0x00, 0x01, 0x04,
+		0x83, 0x03, 0x70, 0x17, 0xa0, 0x0f, 0x07, 0x1e, 0x07, 0x1e, 0x01, 0x00,
+		0x00, 0x00, 0x00, 0x01, 0x00,  // end of msg 1
+		0x06, 0x0d, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0xff, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,  // msg 2 similar init 6
+		0x20, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x57, 0x02, 0x00, 0x00, 0x01,  // msg 3
+		0xe5, 0x04, 0x00, 0x3f, 0x00, 0x00, 0x00,  // msg 4
+		0x02, 0x01, 0x00, 0x03, 0x42, 0x05, 0x10, 0x03 // msg 5 C_RECEIVER_ON
+	};
+
+	uint8_t init_nmea2[] = {
+  0x10, 0x00, 0x22, 0x01, 0x00, 0x01, 0x34, 0x00, 0x10, 0x03, // starts nmea
+  0x10, 0x00, 0x09, 0x00, 0x00, 0x19, 0x00, 0x10, 0x03,
+  0x10, 0x00, 0x06, 0x0d, 0x00, 0x01, 0x20, 0x00, 0x00, 0xc0, 0xff, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x02, 0x10, 0x03,
+  0x10, 0x00, 0xfb, 0x16, 0x00, 0x15, 0x00, 0x28, 0x00, 0x50, 0x00, 0x50, 0x00, 0x96, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x94, 0x02, 0x10, 0x03
+	};
+#endif
+
+	WRITE_PKT(fd, 0x00,0xf5, {0x01});
+	usleep(200000);
+	WRITE_PKT(fd, 0x01,0xf1, {0x05});
+	usleep(200000);
+
+	set_receiver_state(fd, RECEIVER_STATE_IDLE);
+	usleep(200000);
+	if (nmea) {
+		enable_nmea_reports(fd, NMEA_MASK_ALL);
+		usleep(200000);
+		set_receiver_state(fd, RECEIVER_STATE_ON);
+#if 0
+        while(1) {
+	  write(fd, init_nmea_rep, sizeof(init_nmea_rep));
+	  usleep(2000000);
+	}
+#endif
+        } else {
+		WRITE_PKT(fd, 0x01, 0xf0, {});
+		usleep(200000);
+		set_receiver_state(fd, RECEIVER_STATE_IDLE);
+		usleep(200000);
+		WRITE_PKT(fd, 0x01, 0xed, {0x00});
+		usleep(200000);
+		uint8_t pk[] = {0x01,0x0e,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x00,0x00};
+		write_packet(fd, 0x01, 0x06, pk, sizeof(pk));
+		usleep(200000);
+		set_receiver_state(fd, RECEIVER_STATE_ON);
+	}
+}
+
+/* true if any sub packet in the frame would reach a handler */
+static bool frame_subscribed(const uint8_t *buf, size_t len)
+{
+	uint8_t class = buf[1];
+
+	/* the catalog wants to see everything */
+	if ((class == AI2_CLASS_ACK) || default_handler || catalog_path)
+		return true;
+
+	buf += 2;
+	len -= 4;
+	while(len >= 3) {
+		uint16_t sublen = buf[2];
+		sublen <<= 8;
+		sublen |= buf[1];
+		if (is_subscribed(class, buf[0]))
+			return true;
+
+		if (len - 3 < sublen)
+			break;
+
+		buf += 3 + sublen;
+		len -= 3 + sublen;
+	}
+	return false;
+}
+
+static uint16_t ai2_checksum(const uint8_t *buf, size_t len)
+{
+	uint16_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sum += buf[i];
+
+	return sum;
+}
+
+/* returns -1 if the frame is corrupt, 0 otherwise */
+static int process_ai2_frame(struct ai2_frame *frame)
+{
+	uint8_t *buf = frame->data;
+	size_t len = frame->len;
+	uint16_t sum;
+	uint16_t chk;
+	uint8_t class;
+	if (len < 4)
+		return 0;
+
+	if (lazy && !frame_subscribed(buf, len))
+		return 0;
+
+	chk = buf[len - 1];
+	chk <<= 8;
+
+	chk |= buf[len - 2];
+	len -= 2;
+
+	sum = ai2_checksum(buf, len);
+	if (chk != sum) {
+		if (LOG_ON(LOG_INFO, LOG_FRAMING) && decode_err_allowed(frame->rx_ns))
+			decode_err_out("checksum mismatch %04x != %04x\n", (int)chk, (int)sum);
+		return -1;
+	}
+
+	class = buf[1];
+
+	if (class == AI2_CLASS_ACK) {
+		if (showstats)
+			cmd_answered(frame->rx_ns, false);
+		if (!LOG_ON(LOG_DEBUG, LOG_ACKS))
+			return 0;
+		if (jsonout)
+			json_ack();
+		else
+			decode_info_out("decoded ack\n");
+		return 0;
+	}
+	buf += 2;
+	len -= 2;
+
+	while(len >= 3) {
+		uint8_t type;
+		uint16_t sublen;
+		type = buf[0];
+		sublen = buf[2];
+		sublen <<= 8;
+		sublen |= buf[1];
+		buf += 3;
+		len -= 3;
+		if (len < sublen) {
+			if (LOG_ON(LOG_INFO, LOG_FRAMING) && decode_err_allowed(frame->rx_ns))
+				decode_err_out("packet cut off\n");
+			break;
+		}
+		struct ai2_packet pkt = {
+			.class = class,
+			.type = type,
+			.data = buf,
+			.len = sublen,
+			.frame = frame,
+			.rx_ns = frame->rx_ns,
+		};
+		process_packet(&pkt);
+		buf += sublen;
+		len -= sublen;
+	}
+	return 0;
+}
+
+/*
+ * Raw bytes are kept from the start of the current frame candidate on,
+ * so after a corrupt frame we can go back to the next 0x10 <class>
+ * inside of it and try again from there instead of losing everything
+ * up to the next accidental 0x10.
+ */
+struct ai2_deframer {
+	struct ai2_frame *frame;
+	size_t framelen;
+	struct ai2_frame *raw;
+	size_t rawlen;
+	/* candidate starts here in raw, pos is relative to it */
+	size_t start;
+	size_t pos;
+	bool escaping;
+	/* current candidate was found by backtracking */
+	bool backtracked;
+	/* time of the last read */
+	uint64_t rx_ns;
+	unsigned long total;
+	unsigned long frames;
+	unsigned long recovered;
+	unsigned long failed;
+	unsigned long bytes_lost;
+};
+
+static struct ai2_deframer deframer;
+/* complete frames go here, non zero means corrupt */
+static int (*frame_sink)(struct ai2_frame *frame) = process_ai2_frame;
+
+static void deframer_init(struct ai2_deframer *d)
+{
+	size_t size = lock_memory ? max_frame : 1024;
+	size_t rawsize = 2 * size + 4;
+
+	if (rawsize > FRAME_MAX_SIZE)
+		rawsize = FRAME_MAX_SIZE;
+
+	d->frame = frame_get(size);
+	d->raw = frame_get(rawsize);
+	if (lock_memory) {
+		memset(d->frame->data, 0, d->frame->size);
+		memset(d->raw->data, 0, d->raw->size);
+	}
+}
+
+/* dropped bytes are only moved out of the way when space is needed */
+static void deframer_drop(struct ai2_deframer *d, size_t n)
+{
+	d->start += n;
+	d->pos = 0;
+	d->framelen = 0;
+	d->escaping = false;
+}
+
+/* throw away the current candidate up to the next possible frame start */
+static void deframer_resync(struct ai2_deframer *d)
+{
+	const uint8_t *raw = d->raw->data + d->start;
+	size_t avail = d->rawlen - d->start;
+	size_t k;
+	size_t scanned = d->pos;
+
+	d->failed++;
+	for (k = 1; k < avail; k++) {
+		if (raw[k] != 0x10)
+			continue;
+
+		if (k + 1 == avail)
+			break;
+
+		if (raw[k + 1] == 0x10) {
+			/* escaped 0x10 */
+			k++;
+			continue;
+		}
+
+		if (raw[k + 1] != 3)
+			break;
+	}
+	d->bytes_lost += k;
+	deframer_drop(d, k);
+	/* only count frames which started inside of the broken one */
+	d->backtracked = (k < scanned) && (d->rawlen > d->start);
+}
+
+static void deframer_frame_done(struct ai2_deframer *d)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	d->frame->len = d->framelen;
+	d->frame->rx_ns = d->rx_ns;
+	ret = frame_sink(d->frame);
+	trace_end("frame", start, d->framelen);
+	if (ret) {
+		deframer_resync(d);
+		return;
+	}
+
+	d->frames++;
+	if (d->backtracked)
+		d->recovered++;
+
+	d->backtracked = false;
+	if (frame_shared(d->frame)) {
+		/* someone kept it, continue in a fresh one */
+		size_t size = d->frame->size;
+
+		frame_put(d->frame);
+		d->frame = frame_get(size);
+	}
+	deframer_drop(d, d->pos);
+}
+
+/* returns false if the frame cannot grow any more */
+static bool deframer_store(struct ai2_deframer *d, uint8_t c)
+{
+	if (d->framelen == d->frame->size) {
+		size_t size = d->frame->size * 2;
+		struct ai2_frame *f;
+
+		if (d->framelen >= max_frame)
+			return false;
+
+		if (size > max_frame)
+			size = max_frame;
+
+		d->frame->len = d->framelen;
+		f = frame_grow(d->frame, size);
+		if (!f)
+			return false;
+
+		d->frame = f;
+	} else if (d->framelen >= max_frame) {
+		return false;
+	}
+
+	d->frame->data[d->framelen] = c;
+	d->framelen++;
+	return true;
+}
+
+static void deframer_scan(struct ai2_deframer *d)
+{
+	while (d->start + d->pos < d->rawlen) {
+		const uint8_t *raw = d->raw->data + d->start;
+		uint8_t c = raw[d->pos];
+
+		if (d->pos == 0) {
+			if (c != 0x10) {
+				size_t avail = d->rawlen - d->start;
+				const uint8_t *start = memchr(raw, 0x10, avail);
+				size_t skip = start ? start - raw : avail;
+
+				if (LOG_ON(LOG_DEBUG, LOG_FRAMING))
+					decode_err_fill('d', skip);
+				d->bytes_lost += skip;
+				deframer_drop(d, skip);
+				continue;
+			}
+			if (LOG_ON(LOG_DEBUG, LOG_FRAMING))
+				decode_err_fill('\n', 1);
+			d->frame->data[0] = c;
+			d->framelen = 1;
+			d->pos = 1;
+			continue;
+		}
+
+		d->pos++;
+		if (!d->escaping) {
+			if (c == 0x10) {
+				d->escaping = true;
+				continue;
+			}
+
+			if ((d->framelen == 1) && (c == 3)) {
+				if (LOG_ON(LOG_INFO, LOG_FRAMING) && decode_err_allowed(d->rx_ns))
+					decode_err_out("%04lx unexpected end of packet\n",
+						       d->total - (d->rawlen - d->start - d->pos));
+				deframer_resync(d);
+				continue;
+			}
+		} else {
+			d->escaping = false;
+			if (c == 3) {
+				deframer_frame_done(d);
+				continue;
+			}
+
+			if (c != 0x10) {
+				/* unescaped 0x10 <class>, probably a new frame */
+				if (LOG_ON(LOG_INFO, LOG_FRAMING) && decode_err_allowed(d->rx_ns))
+					decode_err_out("unexpected start of frame\n");
+				deframer_resync(d);
+				continue;
+			}
+		}
+
+		if (!deframer_store(d, c)) {
+			if (LOG_ON(LOG_INFO, LOG_FRAMING) && decode_err_allowed(d->rx_ns))
+				decode_err_out("overlong packet, throwing away\n");
+			deframer_resync(d);
+			continue;
+		}
+	}
+
+	if (d->start == d->rawlen)
+		d->start = d->rawlen = 0;
+}
+
+/*
+ * room for at least want more raw bytes, filled by deframer_commit(),
+ * NULL if that is more than the largest frame
+ */
+static uint8_t *deframer_space(struct ai2_deframer *d, size_t want)
+{
+	if (d->start && (d->raw->size - d->rawlen < want)) {
+		memmove(d->raw->data, d->raw->data + d->start, d->rawlen - d->start);
+		d->rawlen -= d->start;
+		d->start = 0;
+	}
+
+	if (d->raw->size - d->rawlen < want) {
+		size_t size = d->raw->size;
+		struct ai2_frame *f;
+
+		while (size - d->rawlen < want)
+			size *= 2;
+
+		d->raw->len = d->rawlen;
+		f = frame_grow(d->raw, size);
+		if (f) {
+			d->raw = f;
+		} else {
+			/* cannot grow, give up on the candidate */
+			d->failed++;
+			d->bytes_lost += d->rawlen - d->start;
+			deframer_drop(d, d->rawlen - d->start);
+			d->start = d->rawlen = 0;
+			if (d->raw->size < want)
+				return NULL;
+		}
+	}
+	return d->raw->data + d->rawlen;
+}
+
+static void deframer_commit(struct ai2_deframer *d, size_t len)
+{
+	d->rawlen += len;
+	d->total += len;
+	deframer_scan(d);
+}
+
+static void deframer_feed(struct ai2_deframer *d, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		size_t n = d->raw->size - d->rawlen;
+
+		if (!n) {
+			/* the current candidate fills all of it */
+			deframer_space(d, 1);
+			continue;
+		}
+
+		if (n > len)
+			n = len;
+
+		memcpy(d->raw->data + d->rawlen, buf, n);
+		buf += n;
+		len -= n;
+		deframer_commit(d, n);
+	}
+}
+
+/*
+ * Wakeups are the voluntary context switches of the reader thread as
+ * counted by the kernel, so they include every blocking syscall.
+ */
+static struct {
+	unsigned long reads;
+	unsigned long polls;
+	unsigned long sleeps;
+	unsigned long flushes;
+	unsigned long bytes;
+	long nvcsw;
+	struct timespec start;
+} reader_stats;
+
+static long thread_nvcsw(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru))
+		return 0;
+
+	return ru.ru_nvcsw;
+}
+
+static void print_reader_stats(void)
+{
+	struct timespec now;
+	long wakeups = thread_nvcsw() - reader_stats.nvcsw;
+	unsigned long syscalls = reader_stats.reads + reader_stats.polls +
+				 reader_stats.sleeps + reader_stats.flushes;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (double)(ts_to_ns(&now) - ts_to_ns(&reader_stats.start)) / 1e9;
+	fprintf(stderr, "reader: wakeups: %ld (%.2f/s) syscalls: %lu reads: %lu bytes/wakeup: %.1f\n",
+		wakeups, wakeups / secs, syscalls, reader_stats.reads,
+		wakeups ? (double)reader_stats.bytes / wakeups : 0.0);
+	if (wakeup_budget)
+		fprintf(stderr, "reader: wakeup budget %u/s %s\n", wakeup_budget,
+			wakeups / secs > wakeup_budget ? "exceeded" : "kept");
+}
+
+static void print_stats(void)
+{
+	struct ai2_deframer *d = &deframer;
+
+	fprintf(stderr, "deframer: bytes: %lu frames: %lu recovered: %lu failed: %lu bytes lost: %lu\n",
+		d->total, d->frames, d->recovered, d->failed, d->bytes_lost);
+	fprintf(stderr, "frame pool: allocations: %lu in use: %lu\n",
+		frame_pool.allocs, frame_pool.in_use);
+	if (reader_stats.reads)
+		print_reader_stats();
+
+	if (fclock.samples)
+		print_fclock_stats();
+
+	print_epoch_stats();
+	print_cmd_stats();
+	print_handler_costs();
+}
+
+/*
+ * A tty in its default cooked mode would hold data back until a newline,
+ * eat the 0x03 ending every frame as ^C and mangle 0x0d, 0x11 and 0x13,
+ * so go raw and restore the old settings on the way out.
+ */
+static int tty_fd = -1;
+static struct termios tty_saved;
+static int tty_serial_flags = -1;
+static int tty_vmin = 1;
+static int tty_vtime = 0;
+
+static void tty_restore(void)
+{
+	if (tty_fd < 0)
+		return;
+
+	tcsetattr(tty_fd, TCSANOW, &tty_saved);
+#ifdef ASYNC_LOW_LATENCY
+	if (tty_serial_flags >= 0) {
+		struct serial_struct ss;
+
+		if (!ioctl(tty_fd, TIOCGSERIAL, &ss)) {
+			ss.flags = tty_serial_flags;
+			ioctl(tty_fd, TIOCSSERIAL, &ss);
+		}
+	}
+#endif
+	tty_fd = -1;
+}
+
+/* a c_cc value for vmin= and vtime=, -1 unless 0 to 255 */
+/* a number from min to max and nothing else, -1 if not */
+static long parse_number(const char *s, long min, long max)
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(s, &end, 0);
+	if ((end == s) || *end || errno || (v < min) || (v > max))
+		return -1;
+
+	return v;
+}
+
+static int parse_cc(const char *s)
+{
+	char *end;
+	long v = strtol(s, &end, 0);
+
+	if ((end == s) || *end || (v < 0) || (v > 255))
+		return -1;
+
+	return v;
+}
+
+static int tty_setup(int fd)
+{
+	struct termios tio;
+
+	if (!isatty(fd))
+		return 0;
+
+	if (tcgetattr(fd, &tty_saved)) {
+		perror("tcgetattr");
+		return -1;
+	}
+
+	tio = tty_saved;
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	/* a read returns as soon as there is something, up to a whole burst */
+	tio.c_cc[VMIN] = tty_vmin;
+	tio.c_cc[VTIME] = tty_vtime;
+	if (tcsetattr(fd, TCSANOW, &tio)) {
+		perror("tcsetattr");
+		return -1;
+	}
+
+	tty_fd = fd;
+	atexit(tty_restore);
+
+#ifdef ASYNC_LOW_LATENCY
+	struct serial_struct ss;
+
+	/* only real serial ports know about this */
+	if (!ioctl(fd, TIOCGSERIAL, &ss)) {
+		tty_serial_flags = ss.flags;
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &ss))
+			tty_serial_flags = -1;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Scheduling setup applies to the calling thread, so the reader
+ * (which also does all the decoding) and the latency probe
+ * get the same treatment.
+ */
+static int rt_prio;
+static bool pin_reader;
+static cpu_set_t reader_cpus;
+static unsigned int latprobe_us;
+
+/* of the probe thread itself, read by whoever prints the stats */
+struct latprobe_stats {
+#ifndef NO_THREADS
+	pthread_mutex_t lock;
+#endif
+	unsigned long samples;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	/* [i] counts latencies below 2^i us */
+	unsigned long hist[16];
+};
+
+static struct latprobe_stats latprobe = {
+#ifndef NO_THREADS
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+	char *end;
+
+	CPU_ZERO(set);
+	do {
+		unsigned long cpu = strtoul(list, &end, 0);
+
+		if ((end == list) || (cpu >= CPU_SETSIZE))
+			return -1;
+
+		CPU_SET(cpu, set);
+		list = end + 1;
+	} while (*end == ',');
+
+	return *end ? -1 : 0;
+}
+
+static void setup_reader_thread(void)
+{
+	if (pin_reader && sched_setaffinity(0, sizeof(reader_cpus), &reader_cpus))
+		perror("sched_setaffinity");
+
+	if (rt_prio) {
+		struct sched_param sp = {
+			.sched_priority = rt_prio,
+		};
+
+		if (sched_setscheduler(0, SCHED_FIFO, &sp))
+			perror("sched_setscheduler");
+	}
+}
+
+static void prefault_stack(void)
+{
+	volatile uint8_t buf[65536];
+
+	memset((uint8_t *)buf, 0, sizeof(buf));
+}
+
+/* everything is allocated up front for frames this size */
+#define MLOCK_MAX_FRAME (1 << 20)
+
+static void setup_memory_lock(void)
+{
+	/* a packet's payload is at most 0xffff, whatever the frame */
+	size_t max_packet = max_frame < 0xffff ? max_frame : 0xffff;
+
+	/* keep freed memory, getting it back would fault again */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		perror("mlockall");
+
+	outbuf_get(8 * max_packet + 64);
+	memset(outbuf.buf, 0, outbuf.size);
+	prefault_stack();
+}
+
+static void latprobe_record(uint64_t lat)
+{
+	unsigned int i = 0;
+	uint64_t us = lat / 1000;
+
+	while (us && (i < 15)) {
+		us >>= 1;
+		i++;
+	}
+
+#ifndef NO_THREADS
+	pthread_mutex_lock(&latprobe.lock);
+#endif
+	latprobe.samples++;
+	latprobe.total_ns += lat;
+	if (lat > latprobe.max_ns)
+		latprobe.max_ns = lat;
+	latprobe.hist[i]++;
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&latprobe.lock);
+#endif
+}
+
+/* measures how late a thread scheduled like the reader wakes up */
+static void *latprobe_loop(void *arg)
+{
+	uint64_t period = (uint64_t)latprobe_us * 1000;
+	uint64_t next;
+
+	trace_thread = "latprobe";
+	setup_reader_thread();
+	prefault_stack();
+	next = now_ns() + period;
+	while (1) {
+		struct timespec ts = {
+			.tv_sec = next / 1000000000ull,
+			.tv_nsec = next % 1000000000ull,
+		};
+		uint64_t now;
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		now = now_ns();
+		trace_end("late", next, 0);
+		latprobe_record(now - next);
+		next += period;
+		if (next < now)
+			next = now + period;
+	}
+	return NULL;
+}
+
+/* the wakeups of the probe thread, the reader's own are not measured */
+static void print_latprobe_stats(void)
+{
+	struct latprobe_stats s;
+	int i;
+
+#ifndef NO_THREADS
+	pthread_mutex_lock(&latprobe.lock);
+#endif
+	s = latprobe;
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&latprobe.lock);
+#endif
+	if (!s.samples)
+		return;
+
+	fprintf(stderr, "latprobe thread latency: samples: %lu avg: %.1fus max: %.1fus\n",
+		s.samples, (double)s.total_ns / s.samples / 1000,
+		(double)s.max_ns / 1000);
+	fprintf(stderr, "latprobe thread latency:");
+	for (i = 0; i < 16; i++)
+		if (s.hist[i])
+			fprintf(stderr, " <%uus: %lu", 1u << i, s.hist[i]);
+
+	fprintf(stderr, "\n");
+}
+
+/*
+ * SIGINT, SIGTERM and SIGHUP make the reader stop at its next read and
+ * leave through exit(), so the archive, trace, catalog and stats are
+ * written out. A second one does not wait for that.
+ */
+static volatile sig_atomic_t quit_signal;
+
+static void quit_handler(int sig, siginfo_t *si, void *ctx)
+{
+	/* only waking up the reader, see reader_stop() */
+	if ((si->si_code == SI_TKILL) && (si->si_pid == getpid()))
+		return;
+
+	if (quit_signal) {
+		tty_restore();
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+	quit_signal = sig;
+}
+
+static void quit_setup(void)
+{
+	struct sigaction sa = {
+		.sa_sigaction = quit_handler,
+		.sa_flags = SA_SIGINFO,
+	};
+
+	/* no SA_RESTART, the read has to return */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+}
+
+#ifndef NO_THREADS
+/* only the thread doing the reading should take them */
+static void quit_mask(int how)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(how, &set, NULL);
+}
+
+/*
+ * Has the reader leave like on a signal, so nothing is closed by the
+ * atexit handlers while it still uses it. It exits on its own, the
+ * kicks only interrupt the read it may be waiting in.
+ */
+static void reader_stop(pthread_t thread)
+{
+	quit_signal = SIGTERM;
+	while (1) {
+		struct timespec ts;
+
+		pthread_kill(thread, SIGTERM);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (!pthread_timedjoin_np(thread, NULL, &ts))
+			return;
+	}
+}
+
+/*
+ * SIGUSR1 prints the stats so far, SIGUSR2 writes the trace. The
+ * catalog is saved every CATALOG_SAVE_NS in between. Handled by a
+ * thread of its own so they can use stdio and files.
+ */
+static void *signal_loop(void *arg)
+{
+	sigset_t *set = arg;
+	uint64_t save_at = now_ns() + CATALOG_SAVE_NS;
+	int sig;
+
+	trace_thread = "signal";
+	quit_mask(SIG_BLOCK);
+	while (1) {
+		uint64_t now = now_ns();
+		struct timespec timeout = { 0 };
+
+		if (catalog_path && (now >= save_at)) {
+			catalog_save();
+			save_at = now + CATALOG_SAVE_NS;
+		}
+		if (catalog_path) {
+			timeout.tv_sec = (save_at - now) / 1000000000ull;
+			timeout.tv_nsec = (save_at - now) % 1000000000ull;
+		}
+
+		sig = sigtimedwait(set, NULL, catalog_path ? &timeout : NULL);
+		if (sig == SIGUSR1) {
+			print_stats();
+			print_latprobe_stats();
+		} else if (sig == SIGUSR2) {
+			trace_write();
+		} else if ((errno != EAGAIN) && (errno != EINTR)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void signal_setup(void)
+{
+	static sigset_t set;
+	pthread_t thread;
+
+	sigemptyset(&set);
+	if (showstats)
+		sigaddset(&set, SIGUSR1);
+	if (tracing)
+		sigaddset(&set, SIGUSR2);
+	if (!showstats && !tracing && !catalog_path)
+		return;
+
+	/* blocked before any other thread is started, so they inherit it */
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_create(&thread, NULL, signal_loop, &set);
+}
+#endif
+
+/*
+ * With a wakeup budget, every cycle blocks twice: waiting for data and
+ * sleeping out the rest of the cycle afterwards while more data piles
+ * up. Output is flushed once per cycle, which also is the end of an
+ * epoch as the receiver sends them in bursts.
+ */
+static void read_budget_wait(int fd, uint64_t *cycle_start)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
+	poll(&pfd, 1, -1);
+	reader_stats.polls++;
+	*cycle_start = now_ns();
+}
+
+static void read_budget_sleep(uint64_t cycle_start)
+{
+	uint64_t next = cycle_start + 2000000000ull / wakeup_budget;
+	struct timespec ts = {
+		.tv_sec = next / 1000000000ull,
+		.tv_nsec = next % 1000000000ull,
+	};
+
+	uint64_t start = trace_start();
+
+	fflush(stdout);
+	if (binout)
+		fflush(binout);
+	trace_end("flush", start, 0);
+	reader_stats.flushes++;
+	start = trace_start();
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	trace_end("sleep", start, 0);
+	reader_stats.sleeps++;
+}
+
+/* size of a single read, also the longest chunk of a capture */
+#define READ_SIZE 4096
+
+/*
+ * Captures keep every read as it came in, one line per read:
+ * "@seconds.nanoseconds hexdata", on the monotonic clock.
+ */
+static int capture_fd = -1;
+
+static void capture_chunk(const uint8_t *buf, size_t len, uint64_t rx_ns)
+{
+	static char line[2 * READ_SIZE + 32];
+	char *p = line;
+
+	p += sprintf(p, "@%" PRIu64 ".%09" PRIu64 " ",
+		     (uint64_t)(rx_ns / 1000000000ull), (uint64_t)(rx_ns % 1000000000ull));
+	p = hex_encode(p, buf, len);
+	*p++ = '\n';
+	if (write(capture_fd, line, p - line) != p - line) {
+		perror("capture");
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+
+static void *read_loop(void *fdp)
+{
+	uint8_t buf[READ_SIZE];
+	int fd = *(int *)fdp;
+	ssize_t ret;
+	uint64_t cycle_start = 0;
+	uint64_t start;
+
+	trace_thread = "reader";
+#ifndef NO_THREADS
+	quit_mask(SIG_UNBLOCK);
+#endif
+	setup_reader_thread();
+	deframer_init(&deframer);
+	if (lock_memory)
+		prefault_stack();
+
+	clock_gettime(CLOCK_MONOTONIC, &reader_stats.start);
+	reader_stats.nvcsw = thread_nvcsw();
+	/* a signal coming in while not in read() is only seen here */
+	while (!quit_signal) {
+		if (wakeup_budget)
+			read_budget_wait(fd, &cycle_start);
+
+		start = trace_start();
+		ret = read(fd, buf, sizeof(buf));
+		trace_end("read", start, ret > 0 ? ret : 0);
+		reader_stats.reads++;
+		if (!ret || quit_signal)
+			break;
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("read");
+			break;
+		}
+		reader_stats.bytes += ret;
+		deframer.rx_ns = now_ns();
+		if (capture_fd >= 0)
+			capture_chunk(buf, ret, deframer.rx_ns);
+		start = trace_start();
+		deframer_feed(&deframer, buf, ret);
+		trace_end("deframe", start, ret);
+		/* there may be more waiting */
+		if (wakeup_budget && (ret < sizeof(buf)))
+			read_budget_sleep(cycle_start);
+	}
+
+	if (showstats) {
+		print_stats();
+		print_latprobe_stats();
+	}
+
+#ifndef NO_THREADS
+	/* main reads commands with the signals blocked, keep taking them */
+	while (noinit && !quit_signal)
+		pause();
+#endif
+
+	/* main may be stuck reading commands from stdin */
+	if (quit_signal)
+		exit(0);
+
+	return NULL;
+}
+
+/* the value of a hex digit, XX for anything else */
+#define XX 0xff
+static const uint8_t hexval[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+#undef XX
+
+/*
+ * Pairs of hex digits become bytes, anything else separates and
+ * throws away a single pending digit. An @ starts a capture timestamp
+ * which is skipped up to the next whitespace. The state survives
+ * across calls so input can be decoded in arbitrary chunks.
+ */
+struct hex_decoder {
+	int hi;
+	bool skip;
+};
+
+#ifdef __has_builtin
+#if __has_builtin(__builtin_convertvector)
+#define HAVE_HEX_SIMD
+#endif
+#endif
+
+#ifdef HAVE_HEX_SIMD
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef int8_t v16s8 __attribute__((vector_size(16)));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+typedef uint8_t v8u8 __attribute__((vector_size(8)));
+
+/* 16 hex digits to 8 bytes, false if there is anything else in there */
+static bool hex_decode16(const uint8_t *src, uint8_t *dest)
+{
+	v16u8 c, digit, letter, val;
+	v16s8 is_digit, is_letter, ok;
+	v8u16 pairs;
+	v8u8 out;
+	uint64_t valid[2];
+
+	memcpy(&c, src, sizeof(c));
+	digit = c - '0';
+	letter = (c | 0x20) - 'a';
+	is_digit = (v16s8)(digit < 10);
+	is_letter = (v16s8)(letter < 6);
+	ok = is_digit | is_letter;
+	memcpy(valid, &ok, sizeof(valid));
+	if (~valid[0] | ~valid[1])
+		return false;
+
+	val = (digit & (v16u8)is_digit) | ((letter + 10) & (v16u8)is_letter);
+	/* little endian: the first digit of each pair is the low byte */
+	pairs = (v8u16)val;
+	pairs = (pairs << 4) | (pairs >> 8);
+	out = __builtin_convertvector(pairs, v8u8);
+	memcpy(dest, &out, sizeof(out));
+	return true;
+}
+#endif
+
+/* dest may be src, at most len / 2 + 1 bytes are written */
+static size_t hex_decode(struct hex_decoder *h, const uint8_t *src, size_t len, uint8_t *dest)
+{
+	const uint8_t *end = src + len;
+	uint8_t *d = dest;
+
+	while (src < end) {
+		uint8_t v;
+
+		if (h->skip) {
+			while ((src < end) && !isspace(*src))
+				src++;
+			if (src == end)
+				break;
+
+			h->skip = false;
+		}
+
+		if (h->hi < 0) {
+#ifdef HAVE_HEX_SIMD
+			while ((end - src >= 16) && hex_decode16(src, d)) {
+				src += 16;
+				d += 8;
+			}
+#endif
+			while (end - src >= 2) {
+				uint8_t hi = hexval[src[0]];
+				uint8_t lo = hexval[src[1]];
+
+				if ((hi | lo) & 0xf0)
+					break;
+
+				*d = (hi << 4) | lo;
+				d++;
+				src += 2;
+			}
+			if (src == end)
+				break;
+		}
+
+		v = hexval[*src];
+		src++;
+		if (v & 0xf0) {
+			h->skip = src[-1] == '@';
+			h->hi = -1;
+		} else if (h->hi < 0) {
+			h->hi = v;
+		} else {
+			*d = (h->hi << 4) | v;
+			d++;
+			h->hi = -1;
+		}
+	}
+	return d - dest;
+}
+
+/* decodes hex dumps straight into the deframer */
+static void hex_replay(int fd)
+{
+	struct hex_decoder h = { .hi = -1 };
+	uint8_t buf[16384];
+	ssize_t ret;
+
+	deframer_init(&deframer);
+	while ((ret = read(fd, buf, sizeof(buf))) != 0) {
+		uint8_t *dest;
+
+		if (quit_signal)
+			break;
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("read");
+			break;
+		}
+		deframer.rx_ns = now_ns();
+		dest = deframer_space(&deframer, ret / 2 + 1);
+		if (!dest)
+			break;
+
+		deframer_commit(&deframer, hex_decode(&h, buf, ret, dest));
+	}
+
+	if (showstats)
+		print_stats();
+}
+
+/* replay speed for captures, 0 for as fast as possible, < 0 for not timed */
+static double replay_speed = -1;
+
+static uint64_t parse_timestamp(const char *s, char **end)
+{
+	uint64_t ns = strtoull(s, end, 10) * 1000000000ull;
+	uint64_t scale = 100000000;
+
+	if (**end == '.') {
+		for ((*end)++; isdigit(**end); (*end)++) {
+			ns += (**end - '0') * scale;
+			scale /= 10;
+		}
+	}
+	return ns;
+}
+
+/*
+ * Replays a capture line by line, every line is handed to the deframer
+ * as one chunk like the original read. Lines with a timestamp are
+ * delayed to keep their distance to the first one, divided by the
+ * replay speed.
+ */
+static void timed_replay(FILE *f)
+{
+	uint64_t first_ts = 0, start = 0;
+	uint64_t chunks = 0, late_total = 0, late_max = 0;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	deframer_init(&deframer);
+	while (((len = getline(&line, &size, f)) > 0) && !quit_signal) {
+		struct hex_decoder h = { .hi = -1 };
+		char *p = line;
+		uint8_t *dest;
+		size_t n;
+
+		if (*p == '@') {
+			uint64_t ts = parse_timestamp(p + 1, &p);
+
+			if (!start) {
+				first_ts = ts;
+				start = now_ns();
+			} else if ((replay_speed > 0) && (ts > first_ts)) {
+				uint64_t due = start + (ts - first_ts) / replay_speed;
+				struct timespec dts = {
+					.tv_sec = due / 1000000000ull,
+					.tv_nsec = due % 1000000000ull,
+				};
+				uint64_t now;
+
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &dts, NULL);
+				now = now_ns();
+				if (now > due) {
+					late_total += now - due;
+					if (now - due > late_max)
+						late_max = now - due;
+				}
+			}
+		}
+
+		deframer.rx_ns = now_ns();
+		dest = deframer_space(&deframer, (line + len - p) / 2 + 1);
+		if (!dest) {
+			fprintf(stderr, "line of %zd bytes is too long\n", len);
+			continue;
+		}
+
+		n = hex_decode(&h, (uint8_t *)p, line + len - p, dest);
+		deframer_commit(&deframer, n);
+		trace_end("deframe", deframer.rx_ns, n);
+		chunks++;
+	}
+	free(line);
+
+	if (showstats) {
+		print_stats();
+		fprintf(stderr, "replay: chunks: %" PRIu64 " late: avg %.1fus max %.1fus\n",
+			chunks, chunks ? late_total / 1e3 / chunks : 0, late_max / 1e3);
+	}
+}
+
+/*
+ * Benchmark over streams a broken receiver or a corrupt capture
+ * could produce, compared to a normal one. Every stream is fed to the
+ * deframer in reads of READ_SIZE with output going to /dev/null,
+ * the best of a few runs counts.
+ */
+static size_t bench_size = 1 << 22;
+/* worst stream may cost this much more per byte than a normal one */
+static double bench_limit = 5;
+
+static size_t bench_packet(uint8_t *dest, uint8_t type, const void *data, size_t len)
+{
+	dest[0] = type;
+	dest[1] = len & 0xff;
+	dest[2] = len >> 8;
+	memcpy(dest + 3, data, len);
+	return len + 3;
+}
+
+static size_t bench_frame(uint8_t *dest, uint8_t class, const uint8_t *body, size_t len, bool bad_sum)
+{
+	uint16_t sum = 0x10 + class;
+	uint8_t tail[2];
+	size_t n = 0;
+	size_t i;
+
+	dest[n++] = 0x10;
+	dest[n++] = class;
+	for (i = 0; i < len; i++) {
+		sum += body[i];
+		dest[n++] = body[i];
+		if (body[i] == 0x10)
+			dest[n++] = 0x10;
+	}
+	if (bad_sum)
+		sum ^= 0x5a5a;
+
+	tail[0] = sum & 0xff;
+	tail[1] = sum >> 8;
+	for (i = 0; i < 2; i++) {
+		dest[n++] = tail[i];
+		if (tail[i] == 0x10)
+			dest[n++] = 0x10;
+	}
+	dest[n++] = 0x10;
+	dest[n++] = 0x03;
+	return n;
+}
+
+/* a receiver doing its job, one epoch per frame */
+static size_t bench_normal(uint8_t *buf, size_t size)
+{
+	uint8_t body[2048], payload[512];
+	struct measurement_sv *m = (struct measurement_sv *)payload;
+	struct position *p = (struct position *)payload;
+	static const char nmea[] = "$GPRMC,123519.00,A,4807.0380,N,01131.0000,E,0.0,0.0,230394,,,A*6A\r\n";
+	uint32_t fcount = 0x10101010;
+	size_t n = 0;
+	int i;
+
+	while (n + 2 * sizeof(body) + 8 < size) {
+		size_t len = 0;
+
+		memset(payload, 0, sizeof(payload));
+		m->fcount = fcount;
+		for (i = 0; i < 12; i++) {
+			m->svdata[i].sv = i + 1;
+			m->svdata[i].snr = 300 + i;
+			m->svdata[i].cno = 400 + i;
+		}
+		len += bench_packet(body + len, AI2_MEASUREMENT, payload,
+				    offsetof(struct measurement_sv, svdata) + 12 * sizeof(m->svdata[0]));
+		memset(payload, 0, sizeof(payload));
+		p->fcount = fcount;
+		p->lat = 0x11223344;
+		p->lon = 0x10203040;
+		for (i = 0; i < 12; i++)
+			p->svdata[i].sv = i + 1;
+		len += bench_packet(body + len, AI2_POSITION, payload,
+				    offsetof(struct position, svdata) + 12 * sizeof(p->svdata[0]));
+		memcpy(payload, &fcount, 4);
+		memcpy(payload + 4, nmea, sizeof(nmea) - 1);
+		len += bench_packet(body + len, AI2_NMEA, payload, 4 + sizeof(nmea) - 1);
+		n += bench_frame(buf + n, AI2_CLASS_NOACK, body, len, false);
+		fcount += 1000;
+	}
+	return n;
+}
+
+/* valid frames which are mostly escaped 0x10 */
+static size_t bench_escapes(uint8_t *buf, size_t size)
+{
+	uint8_t body[1024 + 3];
+	size_t n = 0;
+
+	memset(body, 0x10, sizeof(body));
+	body[0] = 0x42;
+	body[1] = 1024 & 0xff;
+	body[2] = 1024 >> 8;
+	while (n + 2 * sizeof(body) + 8 < size)
+		n += bench_frame(buf + n, AI2_CLASS_NOACK, body, sizeof(body), false);
+
+	return n;
+}
+
+/* frames made of nothing but zero length sub-packets */
+static size_t bench_empty_packets(uint8_t *buf, size_t size)
+{
+	uint8_t body[3 * 1000];
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(body); i += 3)
+		bench_packet(body + i, 0x42, NULL, 0);
+
+	while (n + sizeof(body) + 8 < size)
+		n += bench_frame(buf + n, AI2_CLASS_NOACK, body, sizeof(body), false);
+
+	return n;
+}
+
+/* short frames, all with a wrong checksum */
+static size_t bench_bad_checksums(uint8_t *buf, size_t size)
+{
+	uint8_t body[] = { 0x42, 0x02, 0x00, 0x01, 0x02 };
+	size_t n = 0;
+
+	while (n + 2 * sizeof(body) + 8 < size)
+		n += bench_frame(buf + n, AI2_CLASS_NOACK, body, sizeof(body), true);
+
+	return n;
+}
+
+static size_t bench_fill(uint8_t *buf, size_t size, const uint8_t *pattern, size_t len)
+{
+	size_t n;
+
+	for (n = 0; n + len <= size; n += len)
+		memcpy(buf + n, pattern, len);
+
+	return n;
+}
+
+static size_t bench_all_0x10(uint8_t *buf, size_t size)
+{
+	memset(buf, 0x10, size);
+	return size;
+}
+
+/*
+ * frames which never end, a new one starting just after each has
+ * grown past max_frame and was thrown away
+ */
+static size_t bench_overlong(uint8_t *buf, size_t size)
+{
+	size_t n;
+
+	memset(buf, 0x55, size);
+	for (n = 0; n + 1 < size; n += max_frame + 1) {
+		buf[n] = 0x10;
+		buf[n + 1] = AI2_CLASS_NOACK;
+	}
+	return size;
+}
+
+/* nothing which could start a frame */
+static size_t bench_no_start(uint8_t *buf, size_t size)
+{
+	memset(buf, 0x55, size);
+	return size;
+}
+
+static size_t bench_restarts(uint8_t *buf, size_t size)
+{
+	static const uint8_t pattern[] = { 0x10, 0x01, 0x10, 0x00 };
+
+	return bench_fill(buf, size, pattern, sizeof(pattern));
+}
+
+static size_t bench_empty_frames(uint8_t *buf, size_t size)
+{
+	static const uint8_t pattern[] = { 0x10, 0x03 };
+
+	return bench_fill(buf, size, pattern, sizeof(pattern));
+}
+
+static size_t bench_random(uint8_t *buf, size_t size)
+{
+	uint32_t x = 0x12345678;
+	size_t n;
+
+	for (n = 0; n < size; n++) {
+		/* xorshift, few 0x10 like on a line with noise */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[n] = x;
+	}
+	return size;
+}
+
+static const struct {
+	const char *name;
+	size_t (*fill)(uint8_t *buf, size_t size);
+} bench_streams[] = {
+	{ "normal", bench_normal },
+	{ "escapes", bench_escapes },
+	{ "empty_packets", bench_empty_packets },
+	{ "bad_checksums", bench_bad_checksums },
+	{ "all_0x10", bench_all_0x10 },
+	{ "overlong", bench_overlong },
+	{ "no_start", bench_no_start },
+	{ "restarts", bench_restarts },
+	{ "empty_frames", bench_empty_frames },
+	{ "random", bench_random },
+};
+
+/*
+ * Hardware counters for the benchmark, counting userspace only so
+ * perf_event_paranoid up to 2 is fine. Counters the kernel or cpu do
+ * not offer are left out.
+ */
+enum {
+	BENCH_NS,
+	BENCH_TSC,
+	BENCH_CYCLES,
+	BENCH_INSNS,
+	BENCH_BRANCH_MISSES,
+	BENCH_CACHE_MISSES,
+	BENCH_VALUES,
+};
+
+static const uint64_t bench_perf_config[BENCH_VALUES] = {
+	[BENCH_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+	[BENCH_INSNS] = PERF_COUNT_HW_INSTRUCTIONS,
+	[BENCH_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+	[BENCH_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int bench_perf_fd[BENCH_VALUES] = { [0 ... BENCH_VALUES - 1] = -1 };
+
+struct bench_counts {
+	double v[BENCH_VALUES];
+};
+
+static void bench_perf_setup(void)
+{
+	int i;
+
+	for (i = BENCH_CYCLES; i < BENCH_VALUES; i++) {
+		struct perf_event_attr attr = {
+			.type = PERF_TYPE_HARDWARE,
+			.size = sizeof(attr),
+			.config = bench_perf_config[i],
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+		};
 
-	for (i = 0; i < len; i++) {
-		pktpos = append_packet(pkt, pktpos, data[i]);
-		sum += data[i];
+		bench_perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if ((bench_perf_fd[i] < 0) && (i == BENCH_CYCLES)) {
+			perror("perf_event_open, wall clock only");
+			return;
+		}
 	}
+}
 
-	pkt[pktpos] = sum & 0xff;
-	pktpos++;
+static void bench_read(struct bench_counts *c)
+{
+	int i;
 
-	pkt[pktpos] = sum >> 8;
-	pktpos++;
+	c->v[BENCH_NS] = now_ns();
+	c->v[BENCH_TSC] = cycles_now();
+	for (i = BENCH_CYCLES; i < BENCH_VALUES; i++) {
+		uint64_t val = 0;
 
-	pkt[pktpos] = 0x10;
-	pktpos++;
-	pkt[pktpos] = 0x03;
-	pktpos++;
+		if ((bench_perf_fd[i] >= 0) &&
+		    (read(bench_perf_fd[i], &val, sizeof(val)) != sizeof(val)))
+			val = 0;
+		c->v[i] = val;
+	}
+}
 
-	ret = write(fd, pkt, pktpos);
+static void bench_sub(struct bench_counts *r, const struct bench_counts *a, const struct bench_counts *b)
+{
+	int i;
 
-	free(pkt);
-	return ret;
+	for (i = 0; i < BENCH_VALUES; i++)
+		r->v[i] = a->v[i] - b->v[i];
 }
 
-#define RECEIVER_STATE_OFF 1
-#define RECEIVER_STATE_IDLE 2
-#define RECEIVER_STATE_ON 3
-static int set_receiver_state(int fd, uint8_t state)
+/* noise can make the differences of two runs negative */
+static void bench_sub_clamped(struct bench_counts *r, const struct bench_counts *a, const struct bench_counts *b)
 {
-	return write_packet(fd, 1, 2, &state, 1);
+	int i;
+
+	bench_sub(r, a, b);
+	for (i = 0; i < BENCH_VALUES; i++)
+		if (r->v[i] < 0)
+			r->v[i] = 0;
 }
 
-#define NMEA_MASK_GGA (1 << 0)
-#define NMEA_MASK_GLL (1 << 1)
-#define NMEA_MASK_GSA (1 << 2)
-#define NMEA_MASK_GSV (1 << 3)
-#define NMEA_MASK_RMC (1 << 4)
-#define NMEA_MASK_VTG (1 << 5)
+static void bench_print(const char *name, const struct bench_counts *c, size_t len)
+{
+	double cycles = c->v[BENCH_CYCLES] ? c->v[BENCH_CYCLES] : c->v[BENCH_TSC];
+
+	fprintf(stderr, "  %-10s %8.2f ns/byte", name, c->v[BENCH_NS] / len);
+	if (cycles)
+		fprintf(stderr, " %8.2f cycles/byte", cycles / len);
+	if (c->v[BENCH_CYCLES] && (bench_perf_fd[BENCH_INSNS] >= 0))
+		fprintf(stderr, " ipc %5.2f", c->v[BENCH_INSNS] / c->v[BENCH_CYCLES]);
+	if (bench_perf_fd[BENCH_BRANCH_MISSES] >= 0)
+		fprintf(stderr, " branch-misses/byte %.4f", c->v[BENCH_BRANCH_MISSES] / len);
+	if (bench_perf_fd[BENCH_CACHE_MISSES] >= 0)
+		fprintf(stderr, " cache-misses/byte %.4f", c->v[BENCH_CACHE_MISSES] / len);
+	fprintf(stderr, "\n");
+}
 
-#define NMEA_MASK_ALL (NMEA_MASK_GGA | NMEA_MASK_GLL | NMEA_MASK_GSA | NMEA_MASK_GSV | NMEA_MASK_RMC | NMEA_MASK_VTG)
+static void bench_nop(const struct ai2_packet *pkt)
+{
+}
 
-static int enable_nmea_reports(int fd, uint8_t mask)
+static int bench_drop_frame(struct ai2_frame *frame)
 {
-	uint8_t buf[4] = {0};
-	buf[0] = mask;
-	return write_packet(fd, 1, 0xe5, buf, sizeof(buf));
+	return 0;
 }
 
-#define WRITE_PKT(fd, class, type, data) do { uint8_t d[] = data; write_packet(fd, (class), (type), d, sizeof(d)); } while(0)
+static struct {
+	struct ai2_frame **frames;
+	size_t count;
+	size_t size;
+} bench_frames;
 
-static void write_init(int fd, bool nmea)
+static int bench_keep_frame(struct ai2_frame *frame)
 {
-#if 0
-	uint8_t init_nmea[] = {
-		0x10, 0x01, 0x08, 0x18, 0x00, 0x00, 0x01, 0x3c, 0x01, 0x00, 0x01, 0x04,
-		0x83, 0x03, 0x70, 0x17, 0xa0, 0x0f, 0x07, 0x1e, 0x07, 0x1e, 0x01, 0x00,
-		0x00, 0x00, 0x00, 0x01, 0x00,  // end of msg 1
-		0x06, 0x0d, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0xff, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,  // msg 2 similar init 6
-		0x20, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x57, 0x02, 0x00, 0x00, 0x01,  // msg 3
-		0xe5, 0x04, 0x00, 0x3f, 0x00, 0x00, 0x00,  // msg 4
-		0x02, 0x01, 0x00, 0x03, 0x42, 0x05, 0x10, 0x03 // msg 5 C_RECEIVER_ON
-	};
+	if (bench_frames.count == bench_frames.size) {
+		bench_frames.size = bench_frames.size ? 2 * bench_frames.size : 1024;
+		bench_frames.frames = realloc(bench_frames.frames,
+					      bench_frames.size * sizeof(*bench_frames.frames));
+		if (!bench_frames.frames) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	frame_ref(frame);
+	bench_frames.frames[bench_frames.count++] = frame;
+	return 0;
+}
 
-	uint8_t init_nmea2[] = {
-  0x10, 0x00, 0x22, 0x01, 0x00, 0x01, 0x34, 0x00, 0x10, 0x03, // starts nmea
-  0x10, 0x00, 0x09, 0x00, 0x00, 0x19, 0x00, 0x10, 0x03,
-  0x10, 0x00, 0x06, 0x0d, 0x00, 0x01, 0x20, 0x00, 0x00, 0xc0, 0xff, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x02, 0x10, 0x03,
-  0x10, 0x00, 0xfb, 0x16, 0x00, 0x15, 0x00, 0x28, 0x00, 0x50, 0x00, 0x50, 0x00, 0x96, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x94, 0x02, 0x10, 0x03
-	};
-#endif
+static void bench_deframe(const uint8_t *buf, size_t len)
+{
+	size_t off;
 
-	WRITE_PKT(fd, 0x00,0xf5, {0x01});
-	usleep(200000);
-	WRITE_PKT(fd, 0x01,0xf1, {0x05});
-	usleep(200000);
+	deframer_init(&deframer);
+	for (off = 0; off < len; off += READ_SIZE) {
+		size_t n = len - off < READ_SIZE ? len - off : READ_SIZE;
 
-	set_receiver_state(fd, RECEIVER_STATE_IDLE);
-	usleep(200000);
-	if (nmea) {
-		enable_nmea_reports(fd, NMEA_MASK_ALL);
-		usleep(200000);
-		set_receiver_state(fd, RECEIVER_STATE_ON);
-#if 0
-        while(1) {
-	  write(fd, init_nmea_rep, sizeof(init_nmea_rep));
-	  usleep(2000000);
-	}
-#endif
-        } else {
-		WRITE_PKT(fd, 0x01, 0xf0, {});
-		usleep(200000);
-		set_receiver_state(fd, RECEIVER_STATE_IDLE);
-		usleep(200000);
-		WRITE_PKT(fd, 0x01, 0xed, {0x00});
-		usleep(200000);
-		uint8_t pk[] = {0x01,0x0e,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x00,0x00};
-		write_packet(fd, 0x01, 0x06, pk, sizeof(pk));
-		usleep(200000);
-		set_receiver_state(fd, RECEIVER_STATE_ON);
+		deframer.rx_ns = now_ns();
+		deframer_feed(&deframer, buf + off, n);
 	}
+	fflush(stdout);
+	frame_put(deframer.frame);
+	frame_put(deframer.raw);
+	memset(&deframer, 0, sizeof(deframer));
 }
 
-static void process_ai2_frame(uint8_t *buf, size_t len)
+enum {
+	STAGE_ALL,
+	STAGE_DEFRAME,
+	STAGE_CHECKSUM,
+	STAGE_DISPATCH,
+	STAGE_FORMAT,
+	STAGES,
+};
+
+/*
+ * Stages are measured by running them on their own: the deframer
+ * without processing, the checksum over the frames it found, then
+ * processing with handlers which do nothing and finally with the
+ * real ones. Dispatch and formatting are the differences.
+ */
+static void bench_stage(int stage, const uint8_t *buf, size_t len, struct bench_counts *c)
 {
-	uint16_t sum;
-	uint16_t chk;
-	uint8_t class, type;
+	static struct handler_list saved[AI2_CLASSES][256];
+	packet_handler saved_default = default_handler;
+	struct bench_counts start, end;
+	volatile uint16_t sum = 0;
 	size_t i;
-	if (len < 4)
-		return;
-
-	chk = buf[len - 1];
-	chk <<= 8;
+	int j, k;
 
-	chk |= buf[len - 2];
-	len -= 2;
+	if (stage == STAGE_DISPATCH) {
+		memcpy(saved, dispatch, sizeof(saved));
+		for (j = 0; j < AI2_CLASSES; j++)
+			for (k = 0; k < 256; k++)
+				for (i = 0; i < dispatch[j][k].count; i++)
+					dispatch[j][k].fn[i] = bench_nop;
+		if (default_handler)
+			default_handler = bench_nop;
+	}
 
-	for(i = 0, sum = 0; i < len; i++)
-		sum += buf[i];
+	frame_sink = bench_drop_frame;
+	bench_read(&start);
+	switch (stage) {
+	case STAGE_ALL:
+		frame_sink = process_ai2_frame;
+		bench_deframe(buf, len);
+		break;
+	case STAGE_DEFRAME:
+		bench_deframe(buf, len);
+		break;
+	case STAGE_CHECKSUM:
+		for (i = 0; i < bench_frames.count; i++)
+			sum += ai2_checksum(bench_frames.frames[i]->data,
+					    bench_frames.frames[i]->len);
+		break;
+	default:
+		for (i = 0; i < bench_frames.count; i++)
+			process_ai2_frame(bench_frames.frames[i]);
+		fflush(stdout);
+		break;
+	}
+	bench_read(&end);
+	bench_sub(c, &end, &start);
+	frame_sink = process_ai2_frame;
 
-	if (chk != sum) {
-		decode_err_out("checksum mismatch %04x != %04x\n", (int)chk, (int)sum);
-		return;
+	if (stage == STAGE_DISPATCH) {
+		memcpy(dispatch, saved, sizeof(saved));
+		default_handler = saved_default;
 	}
+}
 
-	class = buf[1];
+static int run_bench(void)
+{
+	static const char *stage_names[STAGES] = {
+		"all", "deframe", "checksum", "dispatch", "format",
+	};
+	uint8_t *buf = malloc(bench_size);
+	double normal = 0, worst = 0;
+	const char *worst_name = "";
+	unsigned int i;
+	int stage;
+	int run;
 
-	if (class == 2) {
-		decode_info_out("decoded ack\n");
-		return;
+	if (!buf) {
+		perror("malloc");
+		return 1;
 	}
-	buf += 2;
-	len -= 2;
 
-	while(len >= 3) {
-		uint8_t type;
-		uint16_t sublen;
-		type = buf[0];
-		sublen = buf[2];
-		sublen <<= 8;
-		sublen |= buf[1];
-		buf += 3;
-		len -= 3;
-		if (len < sublen) {
-			decode_err_out("packet cut off\n");
-			break;
-		}
-		process_packet(class, type, buf, sublen);
-		buf += sublen;
-		len -= sublen;
+	if (!freopen("/dev/null", "w", stdout)) {
+		perror("/dev/null");
+		return 1;
 	}
-}
+	/* stderr has the results */
+	json_errors = stdout;
 
-static void *read_loop(void *fdp)
-{
-	FILE *f;
-	uint8_t gpsbuf[1024];
-	int fd = *(int *)fdp;
-	int c;
-	int totalbufpos = 0;
-	int bufpos;
-	bool decoding_ack;
-	bool escaping;
-	uint16_t sum;
-	size_t pktlen;
-	f = fdopen(fd, "r");
-	bufpos = 0;
-	pktlen = 0;
-	while((c = fgetc(f)) != EOF) {
-		totalbufpos++;
-		if (bufpos == 0) {
-			escaping = false;
-			if (c != 0x10) {
-				decode_err_out("d");
-				continue;
-			}
-			decode_err_out("\n");
-		}
+	bench_perf_setup();
+	for (i = 0; i < sizeof(bench_streams) / sizeof(bench_streams[0]); i++) {
+		size_t len = bench_streams[i].fill(buf, bench_size);
+		struct bench_counts best[STAGES];
+		double ns_byte;
+		size_t j;
 
-		if (bufpos == 1) {
-			if (c == 3) {
-				decode_err_out("%04x unexpected end of packet\n", totalbufpos);
-				bufpos = 0;
-				continue;
-			}
-		}
+		/* frames for the stages after deframing */
+		frame_sink = bench_keep_frame;
+		bench_deframe(buf, len);
+		frame_sink = process_ai2_frame;
 
-		if ((!escaping) && (c == 0x10) && (bufpos != 0)) {
-			escaping = true;
-			continue;
-		}
+		for (stage = 0; stage < STAGES; stage++) {
+			best[stage].v[BENCH_NS] = INFINITY;
+			for (run = 0; run < 3; run++) {
+				struct bench_counts c;
 
-		if (escaping && (c == 3)) {
-			process_ai2_frame(gpsbuf, bufpos);
-			bufpos = 0;
-			continue;
-		}
-		escaping = false;
-		if (bufpos == sizeof(gpsbuf)) {
-			bufpos = 0;
-			decode_err_out("overlong packet, throwing away\n");
+				bench_stage(stage, buf, len, &c);
+				if (c.v[BENCH_NS] < best[stage].v[BENCH_NS])
+					best[stage] = c;
+			}
 		}
-		gpsbuf[bufpos] = c;
-		bufpos++;
-	}
-	return NULL;
-}
 
+		for (j = 0; j < bench_frames.count; j++)
+			frame_put(bench_frames.frames[j]);
+		bench_frames.count = 0;
 
-static int hexbuf_to_str(const char *src, uint8_t *dest, int len)
-{
-	char buf[5];
-	int i;
-	int c;
-	bool first = true;
-	int destpos = 0;
-	buf[4] = 0;
-	buf[0] = '0';
-	buf[1] = 'x';
-	for(i=0; i < len; i++) {
-		if (!isxdigit(src[i])) {
-			first = true;
-			continue;
-		}
-		if (first) {
-			buf[2] = src[i];
-			first = false;
-		} else {
-			buf[3] = src[i];
-			first = true;
-			dest[destpos] = strtoul(buf, NULL, 0);
-			destpos++;
+		ns_byte = best[STAGE_ALL].v[BENCH_NS] / len;
+		if (!i)
+			normal = ns_byte;
+		if (ns_byte > worst) {
+			worst = ns_byte;
+			worst_name = bench_streams[i].name;
 		}
+
+		fprintf(stderr, "bench %s: %.1f MB/s\n", bench_streams[i].name,
+			len / (best[STAGE_ALL].v[BENCH_NS] / 1e3));
+		/* the differences of the cumulative runs */
+		bench_sub_clamped(&best[STAGE_FORMAT], &best[STAGE_FORMAT], &best[STAGE_DISPATCH]);
+		bench_sub_clamped(&best[STAGE_DISPATCH], &best[STAGE_DISPATCH], &best[STAGE_CHECKSUM]);
+		for (stage = 0; stage < STAGES; stage++)
+			bench_print(stage_names[stage], &best[stage], len);
 	}
-	return destpos;
-}
+	free(buf);
+	free(bench_frames.frames);
 
-void hex_from_stdin_to(int fd)
-{
-	char buf[1024];
-	while(fgets(buf, sizeof(buf), stdin)) {
-		int l = hexbuf_to_str(buf, buf, strlen(buf));
-		write(fd, buf, l);
+	fprintf(stderr, "bench worst: %s %.2f ns/byte, %.1f times normal (limit %.1f)\n",
+		worst_name, worst, worst / normal, bench_limit);
+	if (worst > bench_limit * normal) {
+		fprintf(stderr, "bench: worst case limit exceeded\n");
+		return 1;
 	}
+
+	return 0;
 }
 
 void cmd_from_stdin_to(int fd)
 {
-	char buf[1024];
-	while(fgets(buf, sizeof(buf), stdin)) {
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	while ((len = getline(&line, &size, stdin)) > 0) {
+		struct hex_decoder h = { .hi = -1 };
 		unsigned int class, cmd;
-		char *data;
-		if (sscanf(buf, "%x %x %ms", &class, &cmd, &data) == 3) {
-			int l = hexbuf_to_str(data, data, strlen(buf));
+		int pos;
+
+		if (sscanf(line, "%x %x %n", &class, &cmd, &pos) == 2) {
+			uint8_t *data = (uint8_t *)line + pos;
+			size_t l = hex_decode(&h, data, len - pos, data);
+
+			if (l > UINT16_MAX) {
+				fprintf(stderr, "command of %zu bytes is too long, at most %u\n",
+					l, UINT16_MAX);
+				continue;
+			}
 			write_packet(fd, class, cmd, data, l);
-			free(data);
 		}
 	}
+	free(line);
 }
 
 
@@ -536,50 +4446,251 @@ int main(int argc, char **argv)
 	fd_set fds;
 	bool send_off = false;
 	bool send_idle = false;
-	int pipefds[2] = {-1};
+	int i;
 	if ((argc < 2) || !strcmp(argv[1], "--help")) {
-		fprintf(stderr, "Usage: %s gnssdev [nmea]\n", argv[0]);
+		fprintf(stderr, "Usage: %s gnssdev [nmea|noinit|noprocess|off|idle] [positions] [json] [template=fmt] [verbose=n] [log=list] [hexunknown] [lazy] [stats] [maxframe=bytes] [vmin=n] [vtime=ds] [wakeups=n] [rtprio=n] [cpu=list] [mlock] [latprobe=us] [shm=unit] [capture=file] [speed=x] [trace=file] [catalog=file] [archive=file] [binout=file]\n", argv[0]);
 		return 1;
 	}
 
-	if (argc > 2) {
-		if (!strcmp(argv[2], "nmea"))
+	for (i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "nmea"))
 			nmeaout = true;
 
-		if (!strcmp(argv[2], "noinit"))
+		if (!strcmp(argv[i], "noinit"))
 			noinit = true;
 
-		if (!strcmp(argv[2], "noprocess")) {
+		if (!strcmp(argv[i], "noprocess")) {
 			noinit = true;
 			noprocess = true;
 		}
 
-		if (!strcmp(argv[2], "off")) {
+		if (!strcmp(argv[i], "off")) {
 			noinit = true;
 			send_idle = true;
 			send_off = true;
 		}
 
-		if (!strcmp(argv[2], "idle")) {
+		if (!strcmp(argv[i], "idle")) {
 			noinit = true;
 			send_idle = true;
 		}
+
+		if (!strcmp(argv[i], "positions"))
+			positions_only = true;
+
+		if (!strncmp(argv[i], "template=", 9))
+			template = argv[i] + 9;
+
+		if (!strncmp(argv[i], "verbose=", 8)) {
+			char *end;
+
+			log_level = strtol(argv[i] + 8, &end, 0);
+			if ((end == argv[i] + 8) || *end ||
+			    (log_level < LOG_ERROR) || (log_level > LOG_DEBUG)) {
+				fprintf(stderr, "invalid verbose level %s, %d to %d\n",
+					argv[i] + 8, LOG_ERROR, LOG_DEBUG);
+				return 1;
+			}
+		}
+
+		if (!strncmp(argv[i], "log=", 4) && parse_log_categories(argv[i] + 4)) {
+			fprintf(stderr, "invalid log categories %s\n", argv[i] + 4);
+			return 1;
+		}
+
+		if (!strcmp(argv[i], "json")) {
+			jsonout = true;
+			json_errors = stderr;
+		}
+
+		if (!strcmp(argv[i], "hexunknown"))
+			hexunknown = true;
+
+		if (!strcmp(argv[i], "lazy"))
+			lazy = true;
+
+		if (!strcmp(argv[i], "stats"))
+			showstats = true;
+
+		if (!strncmp(argv[i], "wakeups=", 8)) {
+			long n = parse_number(argv[i] + 8, 0, MAX_WAKEUPS);
+
+			if (n < 0) {
+				fprintf(stderr, "invalid wakeups %s, 0 to %d\n",
+					argv[i] + 8, MAX_WAKEUPS);
+				return 1;
+			}
+			wakeup_budget = n;
+		}
+
+		if (!strncmp(argv[i], "rtprio=", 7)) {
+			rt_prio = parse_number(argv[i] + 7, 0, 99);
+			if (rt_prio < 0) {
+				fprintf(stderr, "invalid rtprio %s, 0 to 99\n", argv[i] + 7);
+				return 1;
+			}
+		}
+
+		if (!strncmp(argv[i], "cpu=", 4)) {
+			if (parse_cpus(argv[i] + 4, &reader_cpus)) {
+				fprintf(stderr, "invalid cpu list %s\n", argv[i] + 4);
+				return 1;
+			}
+			pin_reader = true;
+		}
+
+		if (!strncmp(argv[i], "shm=", 4)) {
+			shm_unit = parse_number(argv[i] + 4, 0, 255);
+			if (shm_unit < 0) {
+				fprintf(stderr, "invalid shm unit %s, 0 to 255\n", argv[i] + 4);
+				return 1;
+			}
+		}
+
+		if (!strcmp(argv[i], "mlock"))
+			lock_memory = true;
+
+		if (!strncmp(argv[i], "latprobe=", 9)) {
+			long us = parse_number(argv[i] + 9, 0, 1000000);
+
+			if (us < 0) {
+				fprintf(stderr, "invalid latprobe %s, 0 to 1000000 us\n",
+					argv[i] + 9);
+				return 1;
+			}
+			latprobe_us = us;
+		}
+
+		if (!strncmp(argv[i], "capture=", 8)) {
+			capture_fd = open(argv[i] + 8, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (capture_fd < 0) {
+				perror(argv[i] + 8);
+				return 1;
+			}
+		}
+
+		if (!strncmp(argv[i], "benchsize=", 10))
+			bench_size = strtoul(argv[i] + 10, NULL, 0);
+
+		if (!strncmp(argv[i], "benchlimit=", 11))
+			bench_limit = atof(argv[i] + 11);
+
+		if (!strncmp(argv[i], "catalog=", 8))
+			catalog_path = argv[i] + 8;
+
+		if (!strncmp(argv[i], "archive=", 8))
+			archive_path = argv[i] + 8;
+
+		if (!strncmp(argv[i], "binout=", 7)) {
+			binout_path = argv[i] + 7;
+			binout_stdout = !strcmp(binout_path, "-");
+		}
+
+		if (!strncmp(argv[i], "trace=", 6))
+			trace_path = argv[i] + 6;
+
+		if (!strncmp(argv[i], "speed=", 6))
+			replay_speed = atof(argv[i] + 6);
+
+		if (!strncmp(argv[i], "vmin=", 5)) {
+			tty_vmin = parse_cc(argv[i] + 5);
+			if (tty_vmin < 0) {
+				fprintf(stderr, "invalid vmin %s, 0 to 255\n", argv[i] + 5);
+				return 1;
+			}
+		}
+
+		if (!strncmp(argv[i], "vtime=", 6)) {
+			tty_vtime = parse_cc(argv[i] + 6);
+			if (tty_vtime < 0) {
+				fprintf(stderr, "invalid vtime %s, 0 to 255\n", argv[i] + 6);
+				return 1;
+			}
+		}
+
+		if (!strncmp(argv[i], "maxframe=", 9)) {
+			max_frame = strtoul(argv[i] + 9, NULL, 0);
+			if (max_frame < 4)
+				max_frame = 4;
+			if (max_frame > FRAME_MAX_SIZE)
+				max_frame = FRAME_MAX_SIZE;
+		}
+	}
+
+	if (template && template_compile(template))
+		return 1;
+
+	if (lock_memory && (max_frame > MLOCK_MAX_FRAME)) {
+		fprintf(stderr, "maxframe %zu too large for mlock, at most %d\n",
+			max_frame, MLOCK_MAX_FRAME);
+		return 1;
 	}
 
+	/*
+	 * the bench is about decoding, not the stats. Complaints about
+	 * broken frames stay, their rate limiting is part of the cost.
+	 */
+	if (!strcmp(argv[1], "bench")) {
+		showstats = false;
+		shm_unit = -1;
+	}
+
+	setup_handlers();
+	if (trace_path)
+		trace_setup();
+
+	if (catalog_path)
+		catalog_setup();
+
+	if (archive_path && archive_setup())
+		return 1;
+
+	if (binout_path && binout_setup())
+		return 1;
+
+#ifndef NO_THREADS
+	signal_setup();
+#endif
+
+	if ((shm_unit >= 0) && shm_setup())
+		return 1;
+
+	/* flushed at the end of each cycle */
+	if (wakeup_budget)
+		setvbuf(stdout, NULL, _IOFBF, 65536);
+
+	if (lock_memory)
+		setup_memory_lock();
+
+	if (!strcmp(argv[1], "bench"))
+		return run_bench();
+
+	quit_setup();
 	if (!strcmp(argv[1], "-")) {
-		pipe(pipefds);
-		noinit = true;
-		fd = pipefds[0];
-	} else {
-		fd = open(argv[1], O_RDWR);
+		if (replay_speed >= 0)
+			timed_replay(stdin);
+		else
+			hex_replay(STDIN_FILENO);
+		return 0;
 	}
+
+	fd = open(argv[1], O_RDWR | O_NOCTTY);
 	if (fd < 0) {
 		fprintf(stderr, "Cannot open %s\n", argv[1]);
 		return 1;
 	}
 
+	if (tty_setup(fd))
+		return 1;
+
 #ifndef NO_THREADS
 	pthread_t thread;
+	quit_mask(SIG_BLOCK);
+	if (latprobe_us) {
+		pthread_t probe;
+
+		pthread_create(&probe, NULL, latprobe_loop, NULL);
+	}
 	pthread_create(&thread, NULL, read_loop, &fd);
 #endif
 	if (!noinit)
@@ -598,13 +4709,10 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-	if (pipefds[1] > 0) {
-		hex_from_stdin_to(pipefds[1]);
-		close(pipefds[1]);
-	}
 #ifndef NO_THREADS
-	else if (noinit) {
+	if (noinit) {
 		cmd_from_stdin_to(fd);
+		reader_stop(thread);
 		return 0;
 	}
 